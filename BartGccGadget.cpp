@@ -11,12 +11,13 @@
 namespace Gadgetron {
   
   BartGccGadget::BartGccGadget() :
-  image_counter_(0)
+  image_counter_(0), cancel_(false)
   {}
 
   int BartGccGadget::process_config(ACE_Message_Block* mb)
   {
     GADGET_CHECK_RETURN(BaseClass::process_config(mb) == GADGET_OK, GADGET_FAIL);
+    cancel_ = false;
     
     // -------------------------------------------------
     
@@ -34,10 +35,85 @@ namespace Gadgetron {
     num_encoding_spaces_ = NE;
     GDEBUG_CONDITION_STREAM(verbose.value(), "Number of encoding spaces: " << NE);
     
+    if (numa_binding.value())
+    {
+      GDEBUG_STREAM("Bart jobs are bound to NUMA nodes, " << BartNumaTopology::instance().describe());
+    }
+    
+    BartScratchArena::instance().set_max_recycled(static_cast<size_t>(std::max(0, scratch_max_recycled.value())));
+    BartScratchArena::instance().set_max_spare_bytes(static_cast<size_t>(std::max(0.0f, scratch_max_spare_GB.value())*1024.0*1024.0*1024.0));
+    
+    // a broken bart setup fails here instead of in the first exam, which also finds bart warm
+    if (validate_bart_setup.value() && !BartWarmup::instance().validate(BartBinary_path.value(), "", bart_timeout_s.value()))
+      return GADGET_FAIL;
+    
+    std::string work_location = BartWorkingDirectory.value().empty() ? workingDirectory.value() : BartWorkingDirectory.value();
+    if (warmup_job.value() && !work_location.empty())
+    {
+      if (!BartWarmup::instance().run_once("BartGccGadget\n" + BartBinary_path.value(), [&]() { return this->run_warmup_job(work_location); }))
+	GWARN("Warm-up job failed, the first exam runs cold\n");
+    }
     
     return GADGET_OK;
   }
   
+  int BartGccGadget::close(unsigned long flags)
+  {
+    int ret = BaseClass::close(flags);
+    
+    // the queue is drained, no step of the gadget outlives its stream
+    if (flags)
+      cancel_ = true;
+    
+    return ret;
+  }
+  
+  bool BartGccGadget::run_warmup_job(const std::string& work_location)
+  {
+    std::string folder = BartScratchArena::instance().acquire(work_location);
+    if (folder.empty())
+      return false;
+    
+    // 32x32 kspace of 8 coils, compressed to 4
+    const int RO = 32, E1 = 32, CHA = 8;
+    hoNDArray< std::complex<float> > kspace(RO, E1, 1, CHA);
+    for (int c = 0; c < CHA; c++)
+      for (int e1 = 0; e1 < E1; e1++)
+	for (int ro = 0; ro < RO; ro++)
+	  kspace(ro, e1, 0, c) = std::polar(1.0f / (1.0f + std::hypot(float(ro - RO / 2), float(e1 - E1 / 2))), 0.3f*c);
+    if (!write_BART_Array<std::complex< float > >(std::string(folder + "input_data").c_str(), &kspace))
+    {
+      Gadgetron::cleanup(folder);
+      return false;
+    }
+    
+    BartProcessSpec step;
+    step.working_directory = folder;
+    step.log_file = folder + "bart_job.log";
+    step.timeout_s = bart_timeout_s.value();
+    step.cancel = &cancel_;
+    step.environment["OMP_NUM_THREADS"] = std::to_string((bart_omp_threads.value() > 0) ? bart_omp_threads.value() : availableCpus());
+    
+    std::vector< std::vector<std::string> > commands = {
+      { BartBinary_path.value(), "cc", "-r", "12", "-G", "input_data", "cc_matrix" },
+      { BartBinary_path.value(), "ccapply", "-p", "4", "-G", "input_data", "cc_matrix", "cc_input_data" }
+    };
+    
+    bool ok = true;
+    for (auto & command : commands)
+    {
+      step.argv = command;
+      if (!runBartStep("BartGccGadget::warm-up bart " + command[1], step, perform_timing.value()))
+      {
+	ok = false;
+	break;
+      }
+    }
+    
+    Gadgetron::cleanup(folder);
+    return ok;
+  }
+  
   int BartGccGadget::process(GadgetContainerMessage<IsmrmrdReconData>* m1)
   {
     
@@ -51,6 +127,9 @@ namespace Gadgetron {
       GWARN_STREAM("Incoming recon_bit has more encoding spaces than the protocol : " << recon_bit_->rbit_.size() << " instead of " << num_encoding_spaces_);
     }
     
+    // owner of the arrays left staged, it goes down stream at the end of the message chain
+    GadgetContainerMessage<BartStagedHandle>* staged_handle = nullptr;
+    
     // for every encoding space
     for (size_t e = 0; e < recon_bit_->rbit_.size(); e++)
     {
@@ -72,13 +151,24 @@ namespace Gadgetron {
       }
       
       
-      static std::string outputFolderPath = Gadgetron::CreateBartFileFolder(workLocation_);
-      std::string generatedFilesFolder = std::string(outputFolderPath);
-      boost::filesystem::path dir(generatedFilesFolder);
-      if (boost::filesystem::create_directory(dir))
+      // bind the bart job and the page cache of its workspace to one NUMA node
+      int job_numa_node = -1;
+      if (numa_binding.value())
+      {
+	job_numa_node = (numa_node.value() >= 0) ? numa_node.value() : static_cast<int>(BartNumaTopology::instance().next_node());
+      }
+      std::unique_ptr<BartNumaBinding> numa_bind(new BartNumaBinding(job_numa_node));
+      if (numa_bind->bound())
+      {
+	GDEBUG_CONDITION_STREAM(verbose.value(), "BartGccGadget job of encoding space " << e << " is bound to NUMA node " << numa_bind->node());
+      }
+      
+      // every job gets its own workspace from the scratch arena
+      std::string generatedFilesFolder = BartScratchArena::instance().acquire(workLocation_);
+      if (!generatedFilesFolder.empty())
 	GDEBUG("Folder to store *.hdr & *.cfl files is %s\n", generatedFilesFolder.c_str());
       else {
-	GERROR("Folder to store *.hdr & *.cfl files doesn't exist...\n");
+	GERROR("Failed to create folder to store *.hdr & *.cfl files in %s\n", workLocation_.c_str());
 	return GADGET_FAIL;
       }
       
@@ -86,8 +176,8 @@ namespace Gadgetron {
       // WRITE REFERENCE AND RAW DATA TO FILES 
       std::vector<uint16_t> DIMS_ref, DIMS;
       
-      // Recon bit 
-      Gadgetron::IsmrmrdReconBit it = recon_bit_->rbit_[e];
+      // Recon bit, by reference so that the kspace isn't copied
+      Gadgetron::IsmrmrdReconBit & it = recon_bit_->rbit_[e];
       
       // Grab a reference to the buffer containing the reference data
       auto  & dbuff_ref = it.ref_;
@@ -119,11 +209,19 @@ namespace Gadgetron {
       
       // Write reference data to disk
       GDEBUG_CONDITION_STREAM(true, "Reference Array [E0, E1, E2, CHA, N, S, LOC] = [" << E0_ref <<","<<E1_ref<<","<<E2_ref<<","<<CHA_ref<<","<<N_ref<<","<<S_ref<<","<<LOC_ref<<"]");
-      write_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + "reference_data").c_str(),&ref);
+      bool written = write_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + "reference_data").c_str(),&ref);
       
       // Write kspace data to disk
       GDEBUG_CONDITION_STREAM(true, "Data Array [E0, E1, E2, CHA, N, S, LOC] = [" << E0 <<","<<E1<<","<<E2<<","<<CHA<<","<<N<<","<<S<<","<<LOC<<"]");
-      write_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + "input_data").c_str(), &dbuff.data_);
+      written = written && write_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + "input_data").c_str(), &dbuff.data_);
+      if (!written)
+      {
+	Gadgetron::cleanup(generatedFilesFolder, BartWorkingDirectoryDelete.value());
+	return GADGET_FAIL;
+      }
+      
+      // the gadget thread is bound for the writes only, the bart steps are bound by the launcher
+      numa_bind.reset();
 
       if ( ( DstChaNum.value() < CHA_ref) && (DstChaNum.value() < CHA) )
       {
@@ -132,29 +230,86 @@ namespace Gadgetron {
 	GDEBUG("Bart Geometric Coil Compression will be performed \n");
 	//--------------------------------------------------------------------------//
 	// Calling Bart Geometric Coil Compression
-	std::ostringstream cmd2, cmd3, cmd4;
 	std::replace(generatedFilesFolder.begin(), generatedFilesFolder.end(), '\\', '/');
 	
-	cmd2 << "/home/amax/bart/bart cc -r " << std::min<int>(CalibSize.value(), std::min<int>(E1_ref,E2_ref) )  << " -G " << " reference_data cc_matrix";	 
-	GDEBUG("%s\n", cmd2.str().c_str());
-	if (system(std::string("cd " + generatedFilesFolder + "&&" + cmd2.str()).c_str()))
-	  return GADGET_FAIL;
+	BartProcessSpec step;
+	step.working_directory = generatedFilesFolder;
+	step.log_file = generatedFilesFolder + "bart_job.log";
+	step.timeout_s = bart_timeout_s.value();
+	step.numa_node = job_numa_node;
+	step.cancel = &cancel_;
+	size_t node_cpus = BartNumaTopology::instance().num_cpus(job_numa_node);
+	step.environment["OMP_NUM_THREADS"] = std::to_string((bart_omp_threads.value() > 0) ? bart_omp_threads.value() : ((node_cpus > 0) ? static_cast<int>(node_cpus) : availableCpus()));
 	
-	cmd3 << "/home/amax/bart/bart ccapply -p " << DstChaNum.value()  << " -G " << " input_data cc_matrix cc_input_data";	
-	GDEBUG("%s\n", cmd3.str().c_str());
-	if (system(std::string("cd " + generatedFilesFolder + "&&" + cmd3.str()).c_str()))
-	  return GADGET_FAIL;
+	std::vector< std::vector<std::string> > commands = {
+	  { BartBinary_path.value(), "cc", "-r", std::to_string(std::min<int>(CalibSize.value(), std::min<int>(E1_ref,E2_ref))), "-G", "reference_data", "cc_matrix" },
+	  { BartBinary_path.value(), "ccapply", "-p", std::to_string(DstChaNum.value()), "-G", "input_data", "cc_matrix", "cc_input_data" },
+	  { BartBinary_path.value(), "ccapply", "-p", std::to_string(DstChaNum.value()), "-G", "reference_data", "cc_matrix", "cc_reference_data" }
+	};
 	
-	cmd4 << "/home/amax/bart/bart ccapply -p " << DstChaNum.value()  << " -G " << " reference_data cc_matrix cc_reference_data";
-	GDEBUG("%s\n", cmd4.str().c_str());
-	if (system(std::string("cd " + generatedFilesFolder + "&&" + cmd4.str()).c_str()))
-	  return GADGET_FAIL;
+	for (auto & command : commands)
+	{
+	  step.argv = command;
+	  if (!runBartStep("BartGccGadget::bart " + command[1], step, perform_timing.value()))
+	  {
+	    Gadgetron::cleanup(generatedFilesFolder, BartWorkingDirectoryDelete.value());
+	    return GADGET_FAIL;
+	  }
+	}
 	
 	//-------------------------------------------------------------------------//
 	// Reformat the data back to gadgetron format by Bart command 
 	std::string outputFile = "cc_input_data";
 	std::string outputFile_ref = "cc_reference_data";
 	
+	hoNDArray< std::complex<float> >& data_out = m1->getObjectPtr()->rbit_[e].data_.data_;
+	hoNDArray< std::complex<float> >& ref_out = m1->getObjectPtr()->rbit_[e].ref_->data_;
+	
+	if (share_staged_outputs.value())
+	{
+	  // leave the compressed arrays staged for the BartReconGadget down stream,
+	  // the arrays passed down are copy-on-write mappings of the staged files, owned by the message
+	  hoNDArray< std::complex<float> > data_mapped, ref_mapped;
+	  std::pair<void*, size_t> data_mapping = map_BART_Array(std::string(generatedFilesFolder + outputFile).c_str(), data_mapped);
+	  std::pair<void*, size_t> ref_mapping = map_BART_Array(std::string(generatedFilesFolder + outputFile_ref).c_str(), ref_mapped);
+	  
+	  if (data_mapping.first && ref_mapping.first)
+	  {
+	    std::vector<size_t> data_dims, ref_dims;
+	    data_mapped.get_dimensions(data_dims);
+	    ref_mapped.get_dimensions(ref_dims);
+	    
+	    data_out.clear();
+	    ref_out.clear();
+	    data_out.create(data_dims, data_mapped.get_data_ptr(), false);
+	    ref_out.create(ref_dims, ref_mapped.get_data_ptr(), false);
+	    
+	    BartStagedArrays staged;
+	    staged.workspace = generatedFilesFolder;
+	    staged.data_name = outputFile;
+	    staged.ref_name = outputFile_ref;
+	    staged.delete_workspace = BartWorkingDirectoryDelete.value();
+	    staged.mappings.push_back(data_mapping);
+	    staged.mappings.push_back(ref_mapping);
+	    if (!staged_handle)
+	    {
+	      staged_handle = new GadgetContainerMessage<BartStagedHandle>();
+	      ACE_Message_Block* tail = m1;
+	      while (tail->cont())
+		tail = tail->cont();
+	      tail->cont(staged_handle);
+	    }
+	    staged_handle->getObjectPtr()->add(data_out.get_data_ptr(), staged);
+	    
+	    GDEBUG("Compressed arrays are left staged in %s\n", generatedFilesFolder.c_str());
+	    continue;
+	  }
+	  
+	  unmap_BART_Array(data_mapping);
+	  unmap_BART_Array(ref_mapping);
+	  GWARN("Failed to map the compressed arrays, they are read back instead\n");
+	}
+	
 	boost::shared_ptr< hoNDArray<std::complex< float > > > DATA = 
 	read_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + outputFile).c_str());
 	
@@ -162,28 +317,32 @@ namespace Gadgetron {
 	read_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + outputFile_ref).c_str());
 	
 	// Delete Bart working BartWorkingDirectory
-	if (BartWorkingDirectoryDelete.value()){
-	  Gadgetron::cleanup(outputFolderPath);
-	}
+	Gadgetron::cleanup(generatedFilesFolder, BartWorkingDirectoryDelete.value());
+	
+	if (!DATA || !REF)
+	  return GADGET_FAIL;
 	
 	//---------------------------------------------------------------------//
 	// Assignment and pass down m1
 	// Be careful about the memory 
-	m1->getObjectPtr()->rbit_[e].data_.data_.clear();
-	m1->getObjectPtr()->rbit_[e].ref_->data_.clear();
+	data_out.clear();
+	ref_out.clear();
 	
-	m1->getObjectPtr()->rbit_[e].data_.data_ = *DATA.get();
-	m1->getObjectPtr()->rbit_[e].ref_->data_ = *REF.get();
+	data_out = *DATA.get();
+	ref_out = *REF.get();
 	
       }
       else{
 	GDEBUG("Bart Geometric Coil Compression will be skipped \n");
+	Gadgetron::cleanup(generatedFilesFolder, BartWorkingDirectoryDelete.value());
       }
     
 
     }
 
 
+    if (perform_timing.value()) { gt_timer_local_.stop(); }
+
     if (this->next()->putq(m1) < 0)
     {
       GERROR_STREAM("Put IsmrmrdReconData to Q failed ... ");
@@ -16,6 +16,9 @@
 #include <gadgetron_paths.h>
 
 #include "Bart_fileio.h"
+#include "Bart_numa.h"
+#include "Bart_process.h"
+#include "Bart_warmup.h"
 
 
 #if defined (WIN32)
@@ -45,15 +48,31 @@ namespace Gadgetron {
 	protected:
 		GADGET_PROPERTY(BartWorkingDirectory, std::string, "Absolute path to temporary file location (will default to workingDirectory)", "");
 		GADGET_PROPERTY(BartWorkingDirectoryDelete, bool, "Whether to delete BartWorkingDirectory", true);
+		GADGET_PROPERTY(BartBinary_path, std::string, "Absolute path to the bart executable", "/home/amax/bart/bart");
+		GADGET_PROPERTY(bart_timeout_s, float, "Wall clock limit of every bart step in seconds, the step is killed beyond it (0: no limit)", 0);
+		GADGET_PROPERTY(bart_omp_threads, int, "OMP_NUM_THREADS of the bart steps (0: the cores of the NUMA node the job is bound to, or all cores)", 0);
+		GADGET_PROPERTY(scratch_max_recycled, int, "Scrubbed workspaces kept for reuse per bart working directory", 2);
+		GADGET_PROPERTY(scratch_max_spare_GB, float, "Size bound of the spare staging files kept in a recycled workspace", 1);
+		GADGET_PROPERTY(validate_bart_setup, bool, "Whether process_config checks that bart runs, the stream doesn't start otherwise", true);
+		GADGET_PROPERTY(warmup_job, bool, "Whether process_config runs a tiny coil compression, so that bart and its libraries are warm for the first exam", false);
 		
 		GADGET_PROPERTY(CalibSize, int, "Size of CalibSize", 24);
 		GADGET_PROPERTY(DstChaNum, int, "Compressed Channel Number",12);
+		GADGET_PROPERTY(share_staged_outputs, bool, "Whether to leave the compressed arrays staged for a BartReconGadget down stream instead of reading them back", false);
+
+		GADGET_PROPERTY(numa_binding, bool, "Whether to bind every bart job and its workspace memory to one NUMA node", false);
+		GADGET_PROPERTY(numa_node, int, "NUMA node index used for the bart jobs (-1: round robin over the nodes)", -1);
                 
 		virtual int process_config(ACE_Message_Block* mb);
 		virtual int process(GadgetContainerMessage<IsmrmrdReconData>* m1);
+		virtual int close(unsigned long flags);
+		
+		bool run_warmup_job(const std::string& work_location);
 		
 		long long image_counter_;
 		std::string workLocation_;
+		// the bart steps of the gadget are killed once it is set
+		std::atomic<bool> cancel_;
 		 
 	};
 
@@ -13,12 +13,98 @@
 
 namespace Gadgetron {
   
-  BartReconGadget::BartReconGadget() : image_counter_(0)
+  namespace {
+    // command line argument, formatted like the stream output the script used to get
+    template <typename T> std::string to_arg(const T& v)
+    {
+      std::ostringstream os;
+      os << v;
+      return os.str();
+    }
+    
+    // the arrays BartGccGadget left staged for the message, they live as long as the message
+    BartStagedHandle* staged_handle(GadgetContainerMessage<IsmrmrdReconData>* m1)
+    {
+      for (ACE_Message_Block* mb = m1->cont(); mb; mb = mb->cont())
+      {
+	GadgetContainerMessage<BartStagedHandle>* handle = AsContainerMessage<BartStagedHandle>(mb);
+	if (handle)
+	  return handle->getObjectPtr();
+      }
+      return nullptr;
+    }
+    
+    // whether a and b agree in every dimension but the slice dimension
+    template <typename T> bool same_but_slices(const hoNDArray<T>& a, const hoNDArray<T>& b, size_t slice_dim)
+    {
+      size_t num_dims = std::max(a.get_number_of_dimensions(), b.get_number_of_dimensions());
+      for (size_t d = 0; d < num_dims; d++)
+      {
+	if ( (d != slice_dim) && (a.get_size(d) != b.get_size(d)) )
+	  return false;
+      }
+      return true;
+    }
+    
+    // slices of a Cartesian protocol, which can be stacked into a batch
+    bool batchable(const IsmrmrdReconData& a)
+    {
+      if (a.rbit_.empty())
+	return false;
+      
+      for (auto & bit : a.rbit_)
+      {
+	if ( bit.data_.trajectory_ || (bit.data_.headers_.get_number_of_elements() == 0) )
+	  return false;
+      }
+      return true;
+    }
+    
+    // batchable slices of the same protocol, which can be stacked into one batch
+    bool slices_batchable(const IsmrmrdReconData& a, const IsmrmrdReconData& b)
+    {
+      if (!batchable(a) || !batchable(b) || (a.rbit_.size() != b.rbit_.size()))
+	return false;
+      
+      for (size_t e = 0; e < a.rbit_.size(); e++)
+      {
+	const IsmrmrdDataBuffered& da = a.rbit_[e].data_;
+	const IsmrmrdDataBuffered& db = b.rbit_[e].data_;
+	if ( !same_but_slices(da.data_, db.data_, 6) || !same_but_slices(da.headers_, db.headers_, 4) )
+	  return false;
+	
+	if (bool(a.rbit_[e].ref_) != bool(b.rbit_[e].ref_))
+	  return false;
+	if ( a.rbit_[e].ref_ && (!same_but_slices((*a.rbit_[e].ref_).data_, (*b.rbit_[e].ref_).data_, 6) || !same_but_slices((*a.rbit_[e].ref_).headers_, (*b.rbit_[e].ref_).headers_, 4)) )
+	  return false;
+      }
+      return true;
+    }
+    
+    // parts concatenated along slice_dim, their outermost dimension
+    template <typename T> void stack_slices(const std::vector< hoNDArray<T>* >& parts, size_t slice_dim, hoNDArray<T>& out)
+    {
+      std::vector<size_t> dims;
+      parts[0]->get_dimensions(dims);
+      dims.resize(std::max(dims.size(), slice_dim + 1), 1);
+      dims[slice_dim] = 0;
+      for (auto part : parts)
+	dims[slice_dim] += part->get_size(slice_dim);
+      
+      out.create(dims);
+      T* dst = out.get_data_ptr();
+      for (auto part : parts)
+	dst = std::copy(part->get_data_ptr(), part->get_data_ptr() + part->get_number_of_elements(), dst);
+    }
+  }
+  
+  BartReconGadget::BartReconGadget() : image_counter_(0), remote_transport_(false), cancel_(false)
   {}
   
   int BartReconGadget::process_config(ACE_Message_Block* mb)
   {
     GADGET_CHECK_RETURN(BaseClass::process_config(mb) == GADGET_OK, GADGET_FAIL);
+    cancel_ = false;
     
     // -------------------------------------------------
     
@@ -36,8 +122,101 @@ namespace Gadgetron {
     num_encoding_spaces_ = NE;
     GDEBUG_CONDITION_STREAM(verbose.value(), "Number of encoding spaces: " << NE);
     
+    if (numa_binding.value())
+    {
+      GDEBUG_STREAM("Bart jobs are bound to NUMA nodes, " << BartNumaTopology::instance().describe());
+    }
+    
+    BartScratchArena::instance().set_max_recycled(static_cast<size_t>(std::max(0, scratch_max_recycled.value())));
+    BartScratchArena::instance().set_max_spare_bytes(static_cast<size_t>(std::max(0.0f, scratch_max_spare_GB.value())*1024.0*1024.0*1024.0));
+    
     recon_obj_.resize(NE);
     
+    num_slices_.resize(NE, 1);
+    for (size_t e = 0; e < NE; e++)
+    {
+      if (h.encoding[e].encodingLimits.slice)
+	num_slices_[e] = h.encoding[e].encodingLimits.slice->maximum + 1;
+    }
+    
+    if (use_buffer_pool.value())
+    {
+      // the buffers of a protocol are multi-GB, a fixed bound would drop them on every release
+      size_t max_cached_bytes = static_cast<size_t>(std::max(0.0f, buffer_pool_max_cached_GB.value())*1024.0*1024.0*1024.0);
+      if (max_cached_bytes == 0)
+      {
+	max_cached_bytes = this->protocol_buffer_bytes(h);
+	if (max_cached_bytes == 0)
+	{
+	  max_cached_bytes = size_t(1) << 30;
+	  GWARN("The header has no receiver channels, the buffer pool keeps up to 1 GB, set buffer_pool_max_cached_GB for the protocol\n");
+	}
+      }
+      BartBufferPool::instance().configure(buffer_pool_huge_pages.value(), max_cached_bytes);
+      GDEBUG("Buffer pool keeps up to %.2f GB of released buffers%s\n", max_cached_bytes/(1024.0*1024.0*1024.0), buffer_pool_huge_pages.value() ? ", backed by huge pages" : "");
+    }
+    if (slice_batch_size.value() != 1)
+    {
+      GDEBUG_CONDITION_STREAM(verbose.value(), "Slices are reconstructed in batches of " << ((slice_batch_size.value() > 0) ? slice_batch_size.value() : (int)num_slices_[0]) << " slices, started by the first slice arriving " << slice_batch_deadline_ms.value() << " ms or more after the first slice of the batch");
+    }
+    
+    remote_transport_ = (bart_transport.value() == "remote");
+    if (remote_transport_)
+    {
+      // the workers drop a client without their shared secret
+      std::string token = remote_token.value();
+      if (token.empty() && std::getenv("BART_WORKER_TOKEN"))
+	token = std::getenv("BART_WORKER_TOKEN");
+      if (token.empty())
+      {
+	GERROR("Remote bart transport without a shared secret, set remote_token or BART_WORKER_TOKEN\n");
+	return GADGET_FAIL;
+      }
+      
+      BartRemoteTransport* remote = new BartRemoteTransport(remote_workers.value(), token, remote_compression.value(), remote_io_timeout_s.value(), remote_retry_after_s.value(), remote_fallback_local.value());
+      transport_.reset(remote);
+      if (remote->num_workers() == 0)
+      {
+	GERROR("Remote bart transport without remote_workers\n");
+	return GADGET_FAIL;
+      }
+    }
+    else
+    {
+      if (bart_transport.value() != "local")
+	GWARN("Unknown bart_transport %s, bart runs locally\n", bart_transport.value().c_str());
+      transport_.reset(new BartLocalTransport());
+    }
+    GDEBUG("Bart jobs run %s\n", transport_->describe().c_str());
+    
+    // first exam costs are paid here: a broken bart setup, cold binaries and fft plans;
+    // bart of the remote workers isn't checked from here, a job falling back to the local bart finds it cold
+    if (perform_timing.value()) { gt_timer_.start("BartReconGadget::warm-up"); }
+    std::string CommandScript = AbsoluteBartCommandScript_path.value() + "/" + BartCommandScript_name.value();
+    std::string work_location = BartWorkingDirectory.value().empty() ? workingDirectory.value() : BartWorkingDirectory.value();
+    
+    if (validate_bart_setup.value() && !remote_transport_ && !BartWarmup::instance().validate(BartBinary_path.value(), CommandScript, bart_timeout_s.value()))
+    {
+      if (perform_timing.value()) { gt_timer_.stop(); }
+      return GADGET_FAIL;
+    }
+    
+    if (warmup_fft.value())
+    {
+      std::string wisdom_file = fftw_wisdom_file.value();
+      if (wisdom_file.empty() && !work_location.empty())
+	wisdom_file = (boost::filesystem::path(work_location) / "bart_fftw_wisdom").string();
+      BartWarmup::instance().prepare_fft(headerImageSizes(h), wisdom_file, warmup_fft_time_limit_s.value());
+    }
+    
+    if (warmup_job.value() && !remote_transport_ && !work_location.empty())
+    {
+      bool warm = BartWarmup::instance().run_once("BartReconGadget\n" + BartBinary_path.value() + "\n" + CommandScript, [&]() { return this->run_warmup_job(CommandScript, work_location); });
+      if (!warm)
+	GWARN("Warm-up job failed, the first exam runs cold\n");
+    }
+    if (perform_timing.value()) { gt_timer_.stop(); }
+    
     
     return GADGET_OK;
   }
@@ -49,6 +228,171 @@ namespace Gadgetron {
     
     process_called_times_++;
     
+    // with slice batching, the slices are held back until their batch is started
+    int ret = (slice_batch_size.value() != 1) ? this->batch_slices(m1) : this->process_recon_data(m1);
+    
+    if (use_buffer_pool.value())
+    {
+      GDEBUG_CONDITION_STREAM(verbose.value(), "BartReconGadget buffer pool : " << BartBufferPool::instance().describe());
+    }
+    
+    if (perform_timing.value()) { gt_timer_local_.stop(); }
+    
+    return ret;
+  }
+  
+  int BartReconGadget::close(unsigned long flags)
+  {
+    int ret = BaseClass::close(flags);
+    
+    // slices still waiting for their batch are reconstructed with the slices there are
+    if (flags && !pending_slices_.empty())
+    {
+      GDEBUG_CONDITION_STREAM(verbose.value(), "Stream closed, batch of " << pending_slices_.size() << " waiting slice(s) is started");
+      if (this->flush_slice_batch(nullptr) != GADGET_OK)
+	ret = GADGET_FAIL;
+    }
+    
+    // the queue is drained, no step of the gadget outlives its stream
+    if (flags)
+      cancel_ = true;
+    
+    return ret;
+  }
+  
+  int BartReconGadget::batch_slices(GadgetContainerMessage<IsmrmrdReconData>* m1)
+  {
+    IsmrmrdReconData& recon_data = *m1->getObjectPtr();
+    bool can_batch = batchable(recon_data);
+    
+    // a slice of another size or layout starts a new batch
+    if ( !pending_slices_.empty() && (!can_batch || !slices_batchable(*pending_slices_.front().message->getObjectPtr(), recon_data)) )
+    {
+      if (this->flush_slice_batch(m1) != GADGET_OK)
+	return GADGET_FAIL;
+    }
+    if (!can_batch)
+      return this->process_recon_data(m1);
+    
+    PendingSlice slice;
+    slice.message = m1;
+    slice.arrival = std::chrono::steady_clock::now();
+    pending_slices_.push_back(slice);
+    
+    size_t batch_size = (slice_batch_size.value() > 0) ? static_cast<size_t>(slice_batch_size.value()) : num_slices_[0];
+    size_t num_pending = 0;
+    for (auto & p : pending_slices_)
+      num_pending += p.message->getObjectPtr()->rbit_[0].data_.data_.get_size(6);
+    
+    // the slices may come in any order (e.g. interleaved), the batch is started once every slice of the protocol has arrived;
+    // a slice that arrives again before starts the next round
+    hoNDArray< ISMRMRD::AcquisitionHeader >& headers = recon_data.rbit_[0].data_.headers_;
+    size_t num_msg_slices = recon_data.rbit_[0].data_.data_.get_size(6);
+    slices_arrived_.resize(num_slices_[0], false);
+    for (size_t s = 0; s < num_msg_slices; s++)
+    {
+      size_t slice_index = headers(headers.get_number_of_elements()/num_msg_slices*(s + 1) - 1).idx.slice;
+      if (slice_index >= slices_arrived_.size())
+	continue;
+      if (slices_arrived_[slice_index])
+	slices_arrived_.assign(slices_arrived_.size(), false);
+      slices_arrived_[slice_index] = true;
+    }
+    bool last_slice = (std::find(slices_arrived_.begin(), slices_arrived_.end(), false) == slices_arrived_.end());
+    if (last_slice)
+      slices_arrived_.assign(slices_arrived_.size(), false);
+    
+    // the deadline is only checked when a slice arrives, there is no timer:
+    // a stalled stream keeps its slices until the next slice or the end of the stream
+    double waited_ms = std::chrono::duration<double, std::milli>(slice.arrival - pending_slices_.front().arrival).count();
+    
+    if ( (num_pending >= batch_size) || last_slice || (waited_ms >= slice_batch_deadline_ms.value()) )
+    {
+      GDEBUG_CONDITION_STREAM(verbose.value(), "Batch of " << num_pending << " slices is started, first slice waited " << waited_ms << " ms");
+      return this->flush_slice_batch(m1);
+    }
+    
+    return GADGET_OK;
+  }
+  
+  int BartReconGadget::flush_slice_batch(GadgetContainerMessage<IsmrmrdReconData>* current)
+  {
+    std::vector<PendingSlice> batch;
+    batch.swap(pending_slices_);
+    if (batch.empty())
+      return GADGET_OK;
+    
+    // a single slice is reconstructed as it came, with the arrays staged for it
+    if (batch.size() == 1)
+    {
+      int ret = this->process_recon_data(batch[0].message);
+      if ( (ret != GADGET_OK) && (batch[0].message != current) )
+	batch[0].message->release();
+      return ret;
+    }
+    
+    if (perform_timing.value()) { gt_timer_.start("BartReconGadget::stack slice batch"); }
+    
+    // arrays staged for the slices are copied into the batch, they are released with the slice messages
+    GadgetContainerMessage<IsmrmrdReconData>* batch_message = new GadgetContainerMessage<IsmrmrdReconData>();
+    IsmrmrdReconData& batch_data = *batch_message->getObjectPtr();
+    IsmrmrdReconData& first = *batch[0].message->getObjectPtr();
+    batch_data.rbit_.resize(first.rbit_.size());
+    
+    for (size_t e = 0; e < first.rbit_.size(); e++)
+    {
+      std::vector< hoNDArray< std::complex<float> >* > data, ref;
+      std::vector< hoNDArray< ISMRMRD::AcquisitionHeader >* > headers, ref_headers;
+      for (auto & slice : batch)
+      {
+	IsmrmrdReconBit& bit = slice.message->getObjectPtr()->rbit_[e];
+	data.push_back(&bit.data_.data_);
+	headers.push_back(&bit.data_.headers_);
+	if (bit.ref_)
+	{
+	  ref.push_back(&(*bit.ref_).data_);
+	  ref_headers.push_back(&(*bit.ref_).headers_);
+	}
+      }
+      
+      // [RO E1 E2 CHA N S SLC] and headers [E1 E2 N S SLC]
+      IsmrmrdReconBit& batch_bit = batch_data.rbit_[e];
+      stack_slices(data, 6, batch_bit.data_.data_);
+      stack_slices(headers, 4, batch_bit.data_.headers_);
+      batch_bit.data_.sampling_ = first.rbit_[e].data_.sampling_;
+      if (first.rbit_[e].ref_)
+      {
+	batch_bit.ref_ = IsmrmrdDataBuffered();
+	stack_slices(ref, 6, (*batch_bit.ref_).data_);
+	stack_slices(ref_headers, 4, (*batch_bit.ref_).headers_);
+	(*batch_bit.ref_).sampling_ = (*first.rbit_[e].ref_).sampling_;
+      }
+    }
+    
+    if (perform_timing.value()) { gt_timer_.stop(); }
+    
+    // the images of the batch are sent back per message, see send_out_recon_res
+    for (auto & slice : batch)
+      batch_messages_.push_back(slice.message);
+    int ret = this->process_recon_data(batch_message);
+    batch_messages_.clear();
+    
+    if (ret != GADGET_OK)
+      batch_message->release();
+    for (auto & slice : batch)
+    {
+      if ( (ret == GADGET_OK) || (slice.message != current) )
+	slice.message->release();
+    }
+    
+    return ret;
+  }
+  
+  int BartReconGadget::process_recon_data(GadgetContainerMessage<IsmrmrdReconData>* m1)
+  {
+    // arrays staged by BartGccGadget are unmapped and their workspace recycled once m1 is released
+    BartStagedHandle* staged_arrays = staged_handle(m1);
+    
     IsmrmrdReconData* recon_bit_ = m1->getObjectPtr();
     if (recon_bit_->rbit_.size() > num_encoding_spaces_)
     {
@@ -62,25 +406,6 @@ namespace Gadgetron {
       GDEBUG_CONDITION_STREAM(verbose.value(), "Calling " << process_called_times_ << " , encoding space : " << e);
       GDEBUG_CONDITION_STREAM(verbose.value(), "======================================================================");
       
-      
-      if (recon_bit_->rbit_[e].ref_)
-      {
-	
-	// after this step, the recon_obj_[e].ref_calib_ and recon_obj_[e].ref_coil_map_ are set	    
-	if (perform_timing.value()) { gt_timer_.start("BartReconGadget::make_ref_coil_map"); }
-	this->make_ref_coil_map(*recon_bit_->rbit_[e].ref_,*recon_bit_->rbit_[e].data_.data_.get_dimensions(), recon_obj_[e].ref_calib_, recon_obj_[e].ref_coil_map_, e);
-	if (perform_timing.value()) { gt_timer_.stop(); }
-	
-	// ----------------------------------------------------------
-	
-	// after this step, coil map is computed and stored in recon_obj_[e].coil_map_
-	if (perform_timing.value()) { gt_timer_.start("BartReconGadget::perform_coil_map_estimation"); }
-	this->perform_coil_map_estimation(recon_obj_[e].ref_coil_map_, recon_obj_[e].coil_map_, e);
-	if (perform_timing.value()) { gt_timer_.stop(); }
-	
-      }
-      
-      //-------------------------Bart Recon Start-------------------------------------//
       // Check status of bart commands script 
       std::string CommandScript = AbsoluteBartCommandScript_path.value() + "/" + BartCommandScript_name.value();
       if (!boost::filesystem::exists(CommandScript))
@@ -103,21 +428,86 @@ namespace Gadgetron {
 	return GADGET_FAIL;
       }
       
-      static std::string outputFolderPath = CreateBartFileFolder(workLocation_);
-      std::string generatedFilesFolder = std::string(outputFolderPath);
-      boost::filesystem::path dir(generatedFilesFolder);
-      if (boost::filesystem::create_directory(dir))
-	GDEBUG("Folder to store *.hdr & *.cfl files is %s\n", generatedFilesFolder.c_str());
-      else {
-	GERROR("Folder to store *.hdr & *.cfl files doesn't exist...\n");
-	return GADGET_FAIL;
+      // arrays left staged by BartGccGadget are used in place
+      BartStagedArrays* staged = staged_arrays ? staged_arrays->find(recon_bit_->rbit_[e].data_.data_.get_data_ptr()) : nullptr;
+      bool is_staged = (staged != nullptr);
+      if (is_staged)
+	staged->delete_workspace = BartWorkingDirectoryDelete.value();
+      
+      bool parameter_sweep = !lambda_l1_sweep.value().empty() || !n_iter_l1_sweep.value().empty();
+      
+      // Retrospective reprocessing: identical inputs, coil maps, script and parameters give the result of an earlier job;
+      // the cache needs the coil maps for its key, otherwise they are estimated next to the staging and calibration below
+      std::string cache_folder, cache_key;
+      bool use_cache = use_result_cache.value() && !parameter_sweep;
+      bool coil_maps_done = false;
+      if (use_cache)
+      {
+	this->estimate_coil_maps(recon_bit_->rbit_[e], recon_obj_[e], e);
+	coil_maps_done = true;
+	
+	cache_folder = result_cache_folder.value().empty() ? (boost::filesystem::path(workLocation_) / "bart_result_cache").string() : result_cache_folder.value();
+	if (cache_folder.back() != '/')
+	  cache_folder += "/";
+	
+	if (perform_timing.value()) { gt_timer_.start("BartReconGadget::result cache lookup"); }
+	cache_key = this->compute_result_cache_key(recon_bit_->rbit_[e], recon_obj_[e], CommandScript);
+	// the images the recon would make: the kspace dims as read back from bart (read_BART_Dims), [RO E1 E2 1 N*S 1 SLC]
+	std::vector<size_t> res_dims;
+	recon_bit_->rbit_[e].data_.data_.get_dimensions(res_dims);
+	res_dims.resize(7, 1);
+	res_dims[3] = 1;
+	res_dims[4] *= res_dims[5];
+	res_dims[5] = 1;
+	bool cache_hit = BartResultCache::instance().lookup(cache_folder, cache_key, res_dims, recon_obj_[e].recon_res_.data_);
+	if (perform_timing.value()) { gt_timer_.stop(); }
+	
+	if (cache_hit)
+	{
+	  GDEBUG("Result of encoding space %d is taken from result cache entry %s\n", (int)e, cache_key.c_str());
+	  this->send_out_recon_res(recon_bit_->rbit_[e], recon_obj_[e], e, image_series.value() + ((int)e + 1), "");
+	  recon_bit_->rbit_[e].ref_ = boost::none;
+	  continue;
+	}
+      }
+      
+      //-------------------------Bart Recon Start-------------------------------------//
+      // bind the bart job and the page cache of its workspace to one NUMA node
+      int job_numa_node = -1;
+      if (numa_binding.value())
+      {
+	job_numa_node = (numa_node.value() >= 0) ? numa_node.value() : static_cast<int>(BartNumaTopology::instance().next_node());
+      }
+      
+      // staged arrays are used in their workspace, otherwise
+      // every job gets its own workspace from the scratch arena
+      std::string generatedFilesFolder;
+      std::string input_name = "input_data";
+      std::string reference_name = "reference_data";
+      
+      if (is_staged)
+      {
+	generatedFilesFolder = staged->workspace;
+	input_name = staged->data_name;
+	reference_name = staged->ref_name;
+	GDEBUG("Staged *.hdr & *.cfl files are used in %s\n", generatedFilesFolder.c_str());
+      }
+      else
+      {
+	generatedFilesFolder = BartScratchArena::instance().acquire(workLocation_);
+	if (!generatedFilesFolder.empty())
+	  GDEBUG("Folder to store *.hdr & *.cfl files is %s\n", generatedFilesFolder.c_str());
+	else {
+	  GERROR("Failed to create folder to store *.hdr & *.cfl files in %s\n", workLocation_.c_str());
+	  return GADGET_FAIL;
+	}
       }
       
       // WRITE REFERENCE AND RAW DATA TO FILES 
       std::vector<uint16_t> DIMS_ref, DIMS;
       
-      // Recon bit 
-      Gadgetron::IsmrmrdReconBit it = recon_bit_->rbit_[e];
+      // Recon bit, by reference so that the kspace isn't copied
+      Gadgetron::IsmrmrdReconBit & it = recon_bit_->rbit_[e];
       
       // Grab a reference to the buffer containing the reference data
       auto  & dbuff_ref = it.ref_;
@@ -150,97 +540,543 @@ namespace Gadgetron {
       uint16_t LOC_ref = static_cast<uint16_t>(ref.get_size(6));
       DIMS_ref = { E0_ref, E1_ref, E2_ref, CHA_ref, N_ref, S_ref, LOC_ref };
       
-      // Write reference data to disk
       GDEBUG_CONDITION_STREAM(verbose.value(), "Reference Array [E0, E1, E2, CHA, N, S, LOC] = [" << E0_ref <<","<<E1_ref<<","<<E2_ref<<","<<CHA_ref<<","<<N_ref<<","<<S_ref<<","<<LOC_ref<<"]");
-      write_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + "reference_data").c_str(),&ref);
+      GDEBUG_CONDITION_STREAM(verbose.value(), "Data Array [E0, E1, E2, CHA, N, S, LOC] = [" << E0 <<","<<E1<<","<<E2<<","<<CHA<<","<<N<<","<<S<<","<<LOC<<"]");
+      
+      std::string last_command;
+      if (!getLastBartCommand(CommandScript, last_command))
+      {
+	GERROR("Unable to open %s\n", CommandScript.c_str());
+	if (!is_staged)
+	  cleanup(generatedFilesFolder);
+	return GADGET_FAIL;
+      }
+      std::string outputFile = getOutputFilename(last_command);
+      if (!isPlainFileStem(outputFile))
+      {
+	GERROR("No output file written by the last bart command of %s: %s\n", CommandScript.c_str(), last_command.c_str());
+	if (!is_staged)
+	  cleanup(generatedFilesFolder);
+	return GADGET_FAIL;
+      }
       
-      // Write kspace data to disk
-      if (perform_timing.value()) { gt_timer_.start("BartReconGadget::write out kspace array to disk"); }
+      // Staging and calibration run next to the coil maps and the preview, each on its own thread bound like the job:
+      //   reference write -> ESPIRiT calibration (script -C), when the calibration reads only the reference
+      //   kspace write
+      // the solve waits for both and reads the maps of the calibration (script -M);
+      // a remote job calibrates and solves in one go on its worker
+      std::vector<std::string> calib_args = this->reference_calibration_params(it, reference_name);
+      bool early_calibration = !calib_args.empty() && !remote_transport_;
       
-      GDEBUG_CONDITION_STREAM(verbose.value(), "Data Array [E0, E1, E2, CHA, N, S, LOC] = [" << E0 <<","<<E1<<","<<E2<<","<<CHA<<","<<N<<","<<S<<","<<LOC<<"]");
-      write_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + "input_data").c_str(), &dbuff.data_);
+      std::future<bool> reference_ready = std::async(std::launch::async, [&]()
+      {
+	BartNumaBinding bind(job_numa_node);
+	if (!is_staged && it.ref_)
+	{
+	  if (!write_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + reference_name).c_str(),&ref, BART_SLICE_DIM))
+	    return false;
+	}
+	if (!early_calibration)
+	  return true;
+	
+	BartProcessSpec calib_step = this->make_bart_step(generatedFilesFolder, 0, job_numa_node);
+	calib_step.argv = { CommandScript, "-C", "-m", to_arg(esp_map.value()) };
+	calib_step.argv.insert(calib_step.argv.end(), calib_args.begin(), calib_args.end());
+	calib_step.argv.push_back(input_name);
+	return runBartStep("BartReconGadget::ESPIRiT calibration", calib_step, perform_timing.value());
+      });
       
-      if (perform_timing.value()) { gt_timer_.stop(); } 
+      std::future<bool> kspace_ready = std::async(std::launch::async, [&]()
+      {
+	if (is_staged)
+	  return true;
+	
+	BartNumaBinding bind(job_numa_node);
+	auto start = std::chrono::steady_clock::now();
+	bool written = write_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + input_name).c_str(), &dbuff.data_, BART_SLICE_DIM);
+	GDEBUG_CONDITION_STREAM(perform_timing.value(), "BartReconGadget::write out kspace array to disk : " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms");
+	return written;
+      });
+      
+      if (!coil_maps_done)
+      {
+	this->estimate_coil_maps(it, recon_obj_[e], e);
+      }
       
+      // Progressive mode: send a zero-filled coil combined image of the acquired kspace
+      // before calling bart, so that the latency to the first image doesn't depend on the solver time
+      if (send_preview_image.value())
+      {
+	if (recon_obj_[e].coil_map_.get_size(3) == recon_bit_->rbit_[e].data_.data_.get_size(3))
+	{
+	  // the acquired kspace is combined in place, not copied
+	  std::vector<size_t> data_dims;
+	  recon_bit_->rbit_[e].data_.data_.get_dimensions(data_dims);
+	  this->release_buffer(recon_obj_[e].full_kspace_);
+	  recon_obj_[e].full_kspace_.create(data_dims, recon_bit_->rbit_[e].data_.data_.get_data_ptr(), false);
+	  this->perform_complex_coil_combine(recon_obj_[e]);
+	  this->send_out_recon_res(recon_bit_->rbit_[e], recon_obj_[e], e, preview_image_series.value() + ((int)e + 1), "PREVIEW");
+	  recon_obj_[e].full_kspace_.clear();
+	}
+	else
+	{
+	  GWARN_STREAM("Coil map is not available for encoding space " << e << ", preview image will be skipped");
+	}
+      }
       
-      // Run Bart script
       int isvdPDS = check_sampling_pattern(recon_bit_->rbit_[e].data_.data_);
-      if (perform_timing.value()) { gt_timer_.start("BartReconGadget::ESPIRiT calibration + PICS reconstruction"); }
-      std::string Commands_Line, last_command;
-      ifstream inputFile;
       
-      inputFile.open(CommandScript);
-      if (inputFile.is_open())
+      // the part of the staging and calibration the gadget side didn't hide
+      auto succeeded = [](std::future<bool>& step)
       {
-	while (getline(inputFile, Commands_Line))
+	try
+	{
+	  return step.get();
+	}
+	catch (...)
 	{
-	  if(Commands_Line.empty() || Commands_Line.find("bart") == std::string::npos )
-	    continue;
-	  last_command = Commands_Line;
+	  return false;
 	}
+      };
+      if (perform_timing.value()) { gt_timer_.start("BartReconGadget::wait for staging and ESPIRiT calibration"); }
+      bool kspace_ok = succeeded(kspace_ready);
+      // the calibration is of no use without the kspace, it is killed instead of waited for
+      if (!kspace_ok)
+	cancel_ = true;
+      bool reference_ok = succeeded(reference_ready);
+      if (!kspace_ok)
+	cancel_ = false;
+      if (perform_timing.value()) { gt_timer_.stop(); }
+      
+      if (!kspace_ok || !reference_ok)
+      {
+	if (!is_staged)
+	  cleanup(generatedFilesFolder, BartWorkingDirectoryDelete.value());
+	return GADGET_FAIL;
+      }
+      
+      // only the bart processes are bound, the gadget thread stays unbound so that the OpenMP threads it starts
+      // (coil combination, fft) keep the whole host
+      if (BartNumaTopology::instance().num_cpus(job_numa_node) > 0)
+      {
+	GDEBUG_CONDITION_STREAM(verbose.value(), "BartReconGadget job of encoding space " << e << " is bound to NUMA node " << BartNumaTopology::instance().nodes()[job_numa_node % BartNumaTopology::instance().num_nodes()].id);
+      }
+      
+      // Parameter sweep: one calibration, then concurrent solves on the shared maps, one image series per setting
+      if (parameter_sweep)
+      {
+	int sweep_status = this->perform_parameter_sweep(recon_bit_->rbit_[e], recon_obj_[e], e, CommandScript, generatedFilesFolder, input_name, reference_name, outputFile, early_calibration, job_numa_node);
+	if (!is_staged)
+	  cleanup(generatedFilesFolder, BartWorkingDirectoryDelete.value());
+	if (sweep_status != GADGET_OK)
+	  return GADGET_FAIL;
 	
-	std::ostringstream Script_params;
-	Script_params<<" -w "<< lambda_l1.value()<<" -i " << n_iter_l1.value() <<" -m "<< esp_map.value() <<" input_data "; 
-
-	auto ret = system(std::string("cd " + generatedFilesFolder + "&&" + CommandScript + Script_params.str()).c_str()); 
-        (void)ret;
-
-	inputFile.close();
+	recon_bit_->rbit_[e].ref_ = boost::none;
+	continue;
+      }
+      
+      // Run Bart script, on the maps of the calibration above if there was one
+      if (perform_timing.value()) { gt_timer_.start(early_calibration ? "BartReconGadget::PICS reconstruction" : "BartReconGadget::ESPIRiT calibration + PICS reconstruction"); }
+      BartJob script_job;
+      script_job.step = this->make_bart_step(generatedFilesFolder, 0, job_numa_node);
+      script_job.step.argv = { CommandScript, "-w", to_arg(lambda_l1.value()), "-i", to_arg(n_iter_l1.value()), "-m", to_arg(esp_map.value()) };
+      if (early_calibration)
+      {
+	script_job.step.argv.push_back("-M");
+	script_job.step.argv.push_back("maps");
       }
       else
       {
-	GERROR("Unable to open %s\n", CommandScript.c_str());
-	cleanup(outputFolderPath);
-	return GADGET_FAIL;
+	script_job.step.argv.insert(script_job.step.argv.end(), calib_args.begin(), calib_args.end());
       }
+      script_job.step.argv.push_back(input_name);
       
-      // Grab data from BART files
-      std::string outputFile = getOutputFilename(last_command);
+      // the files the script reads and writes, for a transport that runs it elsewhere
+      script_job.inputs = { input_name + ".hdr", input_name + ".cfl" };
+      if (!calib_args.empty())
+      {
+	script_job.inputs.push_back(reference_name + ".hdr");
+	script_job.inputs.push_back(reference_name + ".cfl");
+      }
+      script_job.outputs = { outputFile + ".hdr", outputFile + ".cfl" };
       
-      boost::shared_ptr< hoNDArray<std::complex< float > > > DATA = 
-      read_BART_Array<std::complex< float > >(std::string(generatedFilesFolder + outputFile).c_str());
+      if (!transport_->run("BartReconGadget::bart script", script_job, perform_timing.value()))
+      {
+	if (perform_timing.value()) { gt_timer_.stop(); }
+	if (!is_staged)
+	  cleanup(generatedFilesFolder, BartWorkingDirectoryDelete.value());
+	return GADGET_FAIL;
+      }
       
-      if (BartWorkingDirectoryDelete.value())
+      // Grab data from BART files, straight into the kspace buffer of the coil combination
+      std::string output_path = generatedFilesFolder + outputFile;
+      std::vector<size_t> output_dims;
+      bool output_read = read_BART_Dims(output_path.c_str(), output_dims);
+      if (output_read)
       {
-	cleanup(outputFolderPath);
+	this->create_buffer(recon_obj_[e].full_kspace_, output_dims);
+	output_read = read_BART_Data(output_path.c_str(), recon_obj_[e].full_kspace_);
       }
+      
+      // a staged workspace is recycled with m1, after its mappings are gone
+      if (!is_staged)
+	cleanup(generatedFilesFolder, BartWorkingDirectoryDelete.value());
       if (perform_timing.value()) { gt_timer_.stop(); } 
+      if (!output_read)
+      {
+	this->release_buffer(recon_obj_[e].full_kspace_);
+	GERROR("Failed to read bart output %s\n", outputFile.c_str());
+	return GADGET_FAIL;
+      }
       //-------------------------Bart Recon Finished-------------------------------------//
       
       // Coil Combination
-      recon_obj_[e].full_kspace_ = *DATA.get();
       if (this->perform_timing.value()) gt_timer_.start("BartReconGadget::perform_coil_combination using CSM... ");
       this->perform_complex_coil_combine(recon_obj_[e]);
       if (this->perform_timing.value()) gt_timer_.stop();
+      this->release_buffer(recon_obj_[e].full_kspace_);
       
-      // sending out image array
-      if (recon_obj_[e].recon_res_.data_.get_number_of_elements() > 0)
+      if (use_cache)
       {
-	
-	if (perform_timing.value()) { gt_timer_.start("BartReconGadget::compute_image_header"); }
-	this->compute_image_header(recon_bit_->rbit_[e], recon_obj_[e].recon_res_, e);
-	if (perform_timing.value()) { gt_timer_.stop(); }
-	
-	
-	if (perform_timing.value()) { gt_timer_.start("BartReconGadget::send_out_image_array"); }
-	//std::ostringstream ostr_image;
-	//ostr_image << "ESPIRIT-" << std::setprecision(5) << lambda_l1.value();
-	//std::string imageInfo = ostr_image.str();
-	this->send_out_image_array(recon_bit_->rbit_[e], recon_obj_[e].recon_res_, e, image_series.value() + ((int)e + 1), GADGETRON_IMAGE_REGULAR);
+	if (perform_timing.value()) { gt_timer_.start("BartReconGadget::result cache store"); }
+	BartResultCache::instance().store(cache_folder, cache_key, recon_obj_[e].recon_res_.data_, static_cast<size_t>(result_cache_size_GB.value()*1024.0*1024.0*1024.0));
 	if (perform_timing.value()) { gt_timer_.stop(); }
-	
       }
       
+      // sending out image array
+      this->send_out_recon_res(recon_bit_->rbit_[e], recon_obj_[e], e, image_series.value() + ((int)e + 1), "");
+      
       recon_bit_->rbit_[e].ref_ = boost::none;
-      recon_obj_[e].recon_res_.data_.clear();
-      recon_obj_[e].recon_res_.headers_.clear();
-      recon_obj_[e].recon_res_.meta_.clear();
     }
     
     m1->release();
+    
     return GADGET_OK;
   }
   
+  void BartReconGadget::send_out_recon_res(IsmrmrdReconBit& recon_bit, ReconObjType& recon_obj, size_t e, int series_num, const std::string& image_comment, const std::vector< std::pair<std::string, double> >& image_meta)
+  {
+    IsmrmrdImageArray& res = recon_obj.recon_res_;
+    if (res.data_.get_number_of_elements() > 0)
+    {
+      // a batch of slices is sent back as the arrays of its messages, each with the headers of its own slices
+      size_t num_batch_slices = 0;
+      for (auto m : batch_messages_)
+	num_batch_slices += m->getObjectPtr()->rbit_[e].data_.data_.get_size(6);
+      
+      if ( !batch_messages_.empty() && (num_batch_slices == res.data_.get_size(6)) )
+      {
+	std::vector<size_t> dims;
+	res.data_.get_dimensions(dims);
+	size_t slice_elements = res.data_.get_number_of_elements() / res.data_.get_size(6);
+	size_t first_slice = 0;
+	for (auto m : batch_messages_)
+	{
+	  IsmrmrdReconBit& slice_bit = m->getObjectPtr()->rbit_[e];
+	  dims[6] = slice_bit.data_.data_.get_size(6);
+	  
+	  IsmrmrdImageArray slice_res;
+	  slice_res.data_.create(dims, res.data_.get_data_ptr() + first_slice*slice_elements, false);
+	  this->send_image_array(slice_bit, slice_res, e, series_num, image_comment, image_meta);
+	  first_slice += dims[6];
+	}
+      }
+      else
+      {
+	this->send_image_array(recon_bit, res, e, series_num, image_comment, image_meta);
+      }
+    }
+    
+    this->release_buffer(res.data_);
+    res.headers_.clear();
+    res.meta_.clear();
+  }
+  
+  void BartReconGadget::send_image_array(IsmrmrdReconBit& recon_bit, IsmrmrdImageArray& res, size_t e, int series_num, const std::string& image_comment, const std::vector< std::pair<std::string, double> >& image_meta)
+  {
+    if (perform_timing.value()) { gt_timer_.start("BartReconGadget::compute_image_header"); }
+    this->compute_image_header(recon_bit, res, e);
+    if (perform_timing.value()) { gt_timer_.stop(); }
+    
+    if (!image_comment.empty())
+    {
+      for (size_t n = 0; n < res.meta_.size(); n++)
+      {
+	res.meta_[n].append(GADGETRON_IMAGECOMMENT, image_comment.c_str());
+      }
+    }
+    
+    for (size_t n = 0; n < res.meta_.size(); n++)
+    {
+      for (auto & meta : image_meta)
+	res.meta_[n].set(meta.first.c_str(), meta.second);
+    }
+    
+    if (perform_timing.value()) { gt_timer_.start("BartReconGadget::send_out_image_array"); }
+    this->send_out_image_array(recon_bit, res, e, series_num, GADGETRON_IMAGE_REGULAR);
+    if (perform_timing.value()) { gt_timer_.stop(); }
+  }
+  
+  int BartReconGadget::perform_parameter_sweep(IsmrmrdReconBit& recon_bit, ReconObjType& recon_obj, size_t e, const std::string& command_script, const std::string& folder, const std::string& input_name, const std::string& reference_name, const std::string& output_name, bool calibrated, int numa_node)
+  {
+    // comma or space separated values, the single valued property if there are none
+    auto parse_sweep_list = [](const std::string& list, float default_value)
+    {
+      std::vector<float> values;
+      boost::char_separator<char> sep(", ;");
+      boost::tokenizer<boost::char_separator<char> > tokens(list, sep);
+      for (auto & token : tokens)
+      {
+	try
+	{
+	  values.push_back(std::stof(token));
+	}
+	catch (...)
+	{
+	  GWARN("Sweep value %s is ignored\n", token.c_str());
+	}
+      }
+      if (values.empty())
+	values.push_back(default_value);
+      return values;
+    };
+    
+    struct SweepSetting
+    {
+      float lambda;
+      int n_iter;
+      std::string folder;
+      int status;
+    };
+    std::vector<SweepSetting> settings;
+    for (float lambda : parse_sweep_list(lambda_l1_sweep.value(), lambda_l1.value()))
+    {
+      for (float n_iter : parse_sweep_list(n_iter_l1_sweep.value(), static_cast<float>(n_iter_l1.value())))
+      {
+	SweepSetting setting;
+	setting.lambda = lambda;
+	setting.n_iter = static_cast<int>(n_iter);
+	setting.folder = folder + "sweep_" + std::to_string(settings.size()) + "/";
+	setting.status = -1;
+	settings.push_back(setting);
+      }
+    }
+    
+    GDEBUG_STREAM("Parameter sweep of encoding space " << e << " : " << settings.size() << " settings");
+    
+    // calibration, once for all settings, unless the maps were made next to the staging
+    if (!calibrated)
+    {
+      if (perform_timing.value()) { gt_timer_.start("BartReconGadget::parameter sweep ESPIRiT calibration"); }
+      BartProcessSpec calib_step = this->make_bart_step(folder, 0, numa_node);
+      calib_step.argv = { command_script, "-C", "-m", to_arg(esp_map.value()) };
+      std::vector<std::string> calib_args = this->reference_calibration_params(recon_bit, reference_name);
+      calib_step.argv.insert(calib_step.argv.end(), calib_args.begin(), calib_args.end());
+      calib_step.argv.push_back(input_name);
+      bool calib_ok = runBartStep("BartReconGadget::parameter sweep ESPIRiT calibration", calib_step, perform_timing.value());
+      if (perform_timing.value()) { gt_timer_.stop(); }
+      if (!calib_ok)
+      {
+	return GADGET_FAIL;
+      }
+    }
+    
+    // solves, every one in its own folder with a share of the cores, all reading the same kspace and maps
+    size_t num_parallel = (sweep_parallel_solves.value() > 0) ? std::min<size_t>(sweep_parallel_solves.value(), settings.size()) : settings.size();
+    int num_threads = std::max(1, this->job_cpus(numa_node) / static_cast<int>(num_parallel));
+    
+    if (perform_timing.value()) { gt_timer_.start("BartReconGadget::parameter sweep PICS reconstructions"); }
+    std::atomic<size_t> next_setting(0);
+    auto solve = [&]()
+    {
+      for (size_t k = next_setting++; k < settings.size(); k = next_setting++)
+      {
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(settings[k].folder, ec);
+	
+	BartProcessSpec solve_step = this->make_bart_step(settings[k].folder, num_threads, numa_node);
+	solve_step.argv = { command_script, "-M", folder + "maps", "-w", to_arg(settings[k].lambda), "-i", to_arg(settings[k].n_iter), "-m", to_arg(esp_map.value()), folder + input_name };
+	settings[k].status = runBartStep("BartReconGadget::parameter sweep setting " + std::to_string(k), solve_step, perform_timing.value()) ? 0 : 1;
+      }
+    };
+    std::vector<std::thread> solvers;
+    for (size_t t = 0; t < num_parallel; t++)
+      solvers.push_back(std::thread(solve));
+    for (auto & solver : solvers)
+      solver.join();
+    if (perform_timing.value()) { gt_timer_.stop(); }
+    
+    size_t num_sent = 0;
+    for (size_t k = 0; k < settings.size(); k++)
+    {
+      // every setting is read into the same kspace buffer
+      std::string output_path = settings[k].folder + output_name;
+      std::vector<size_t> output_dims;
+      bool output_read = (settings[k].status == 0) && read_BART_Dims(output_path.c_str(), output_dims);
+      if (output_read)
+      {
+	this->create_buffer(recon_obj.full_kspace_, output_dims);
+	output_read = read_BART_Data(output_path.c_str(), recon_obj.full_kspace_);
+      }
+      if (!output_read)
+      {
+	GERROR("Parameter sweep setting lambda_l1 = %f, n_iter_l1 = %d failed\n", settings[k].lambda, settings[k].n_iter);
+	continue;
+      }
+      
+      if (this->perform_timing.value()) gt_timer_.start("BartReconGadget::perform_coil_combination using CSM... ");
+      this->perform_complex_coil_combine(recon_obj);
+      if (this->perform_timing.value()) gt_timer_.stop();
+      
+      std::ostringstream comment;
+      comment << "L1_" << settings[k].lambda << "_IT" << settings[k].n_iter;
+      std::vector< std::pair<std::string, double> > image_meta;
+      image_meta.push_back(std::make_pair(std::string("BART_lambda_l1"), static_cast<double>(settings[k].lambda)));
+      image_meta.push_back(std::make_pair(std::string("BART_n_iter_l1"), static_cast<double>(settings[k].n_iter)));
+      image_meta.push_back(std::make_pair(std::string("BART_esp_map"), static_cast<double>(esp_map.value())));
+      
+      int series_num = sweep_image_series.value() + static_cast<int>(k*std::max<size_t>(num_encoding_spaces_, 1) + e) + 1;
+      this->send_out_recon_res(recon_bit, recon_obj, e, series_num, comment.str(), image_meta);
+      num_sent++;
+    }
+    this->release_buffer(recon_obj.full_kspace_);
+    
+    return (num_sent > 0) ? GADGET_OK : GADGET_FAIL;
+  }
+  
+  int BartReconGadget::job_cpus(int numa_node)
+  {
+    if (bart_omp_threads.value() > 0)
+      return bart_omp_threads.value();
+    size_t node_cpus = BartNumaTopology::instance().num_cpus(numa_node);
+    return (node_cpus > 0) ? static_cast<int>(node_cpus) : availableCpus();
+  }
+  
+  BartProcessSpec BartReconGadget::make_bart_step(const std::string& folder, int omp_threads, int numa_node)
+  {
+    BartProcessSpec spec;
+    spec.working_directory = folder;
+    spec.log_file = folder + "bart_job.log";
+    spec.timeout_s = bart_timeout_s.value();
+    spec.numa_node = numa_node;
+    spec.cancel = &cancel_;
+    
+    if (omp_threads <= 0)
+      omp_threads = this->job_cpus(numa_node);
+    spec.environment["OMP_NUM_THREADS"] = std::to_string(omp_threads);
+    spec.environment["BART"] = BartBinary_path.value();
+    return spec;
+  }
+  
+  bool BartReconGadget::run_warmup_job(const std::string& command_script, const std::string& work_location)
+  {
+    std::string folder = BartScratchArena::instance().acquire(work_location);
+    if (folder.empty())
+      return false;
+    
+    // 32x32 kspace of 4 coils, fully sampled center and every other line outside
+    const int RO = 32, E1 = 32, CHA = 4;
+    hoNDArray< std::complex<float> > kspace(RO, E1, 1, CHA);
+    for (int c = 0; c < CHA; c++)
+    {
+      for (int e1 = 0; e1 < E1; e1++)
+      {
+	bool sampled = (e1 % 2 == 0) || (std::abs(e1 - E1 / 2) < 6);
+	for (int ro = 0; ro < RO; ro++)
+	{
+	  float k = std::hypot(float(ro - RO / 2), float(e1 - E1 / 2));
+	  kspace(ro, e1, 0, c) = sampled ? std::polar(1.0f / (1.0f + k), 0.3f*c) : std::complex<float>(0.0f, 0.0f);
+	}
+      }
+    }
+    // a single [RO E1 E2 CHA] slice, write_BART_Array takes a slice dimension for 7D arrays only
+    if (!write_BART_Array<std::complex< float > >(std::string(folder + "input_data").c_str(), &kspace))
+    {
+      cleanup(folder);
+      return false;
+    }
+    
+    BartProcessSpec step = this->make_bart_step(folder, 0);
+    step.argv = { command_script, "-r", "12", "-w", to_arg(lambda_l1.value()), "-i", "2", "-m", "1", "input_data" };
+    bool ok = runBartStep("BartReconGadget::warm-up job", step, perform_timing.value());
+    
+    cleanup(folder);
+    return ok;
+  }
+  
+  std::vector<std::string> BartReconGadget::reference_calibration_params(IsmrmrdReconBit& recon_bit, const std::string& reference_name)
+  {
+    if (!calibrate_on_reference.value() || !recon_bit.ref_)
+      return std::vector<std::string>();
+    
+    hoNDArray< std::complex<float> >& ref = (*recon_bit.ref_).data_;
+    size_t RO = ref.get_size(0);
+    size_t E1 = ref.get_size(1);
+    size_t E2 = ref.get_size(2);
+    
+    // the reference has to be one [RO E1 E2 CHA] volume per slice, otherwise bart would take N, S as extra maps
+    if (ref.get_size(4)*ref.get_size(5) != 1 || ref.get_number_of_elements() == 0)
+    {
+      GWARN_STREAM("Reference of size [N S] = [" << ref.get_size(4) << " " << ref.get_size(5) << "] can't be used for the ESPIRiT calibration, the kspace is used instead");
+      return std::vector<std::string>();
+    }
+    
+    // extent of the fully sampled ACS block, symmetric around the center where ecalib crops the calibration region,
+    // taken from the first slice for all slices of a batch
+    auto sampled = [&](size_t e1, size_t e2) { return std::abs(ref(RO / 2, e1, e2, 0)) > 0; };
+    size_t r1 = 0;
+    while ( (r1 + 1 <= E1 / 2) && (E1 / 2 + r1 + 1 < E1) && sampled(E1 / 2 - r1 - 1, E2 / 2) && sampled(E1 / 2 + r1 + 1, E2 / 2) )
+      r1++;
+    size_t r2 = 0;
+    while ( (r2 + 1 <= E2 / 2) && (E2 / 2 + r2 + 1 < E2) && sampled(E1 / 2, E2 / 2 - r2 - 1) && sampled(E1 / 2, E2 / 2 + r2 + 1) )
+      r2++;
+    
+    size_t calib_E1 = 2*r1 + 1;
+    size_t calib_E2 = (E2 > 1) ? (2*r2 + 1) : 1;
+    size_t calib_RO = std::min(RO, std::max(calib_E1, calib_E2));
+    
+    if (!sampled(E1 / 2, E2 / 2) || calib_E1 < 3)
+    {
+      GWARN_STREAM("ACS region of the reference is too small for the ESPIRiT calibration, the kspace is used instead");
+      return std::vector<std::string>();
+    }
+    
+    GDEBUG_CONDITION_STREAM(verbose.value(), "ESPIRiT calibration on the reference, calibration size [RO E1 E2] = [" << calib_RO << " " << calib_E1 << " " << calib_E2 << "]");
+    
+    std::ostringstream calib_size;
+    calib_size << calib_RO << ":" << calib_E1 << ":" << calib_E2;
+    // the maps take the size of the kspace, given here so that the calibration doesn't wait for the kspace file
+    hoNDArray< std::complex<float> >& data = recon_bit.data_.data_;
+    std::ostringstream map_size;
+    map_size << data.get_size(0) << ":" << data.get_size(1) << ":" << data.get_size(2);
+    return { "-R", reference_name, "-r", calib_size.str(), "-D", map_size.str() };
+  }
+  
+  std::string BartReconGadget::compute_result_cache_key(IsmrmrdReconBit& recon_bit, ReconObjType& recon_obj, const std::string& command_script)
+  {
+    BartContentHash hash;
+    
+    hash.update_array(recon_bit.data_.data_);
+    if (recon_bit.ref_)
+      hash.update_array((*recon_bit.ref_).data_);
+    // the coil maps cover the coil map estimation settings of the gadget
+    hash.update_array(recon_obj.coil_map_);
+    
+    hash.update_file(command_script);
+    hash.update_value(lambda_l1.value());
+    hash.update_value(n_iter_l1.value());
+    hash.update_value(esp_map.value());
+    hash.update_value(calibrate_on_reference.value());
+    
+    // another bart build may give other results
+    boost::system::error_code ec;
+    hash.update(BartBinary_path.value());
+    hash.update_value(boost::filesystem::file_size(BartBinary_path.value(), ec));
+    hash.update_value(boost::filesystem::last_write_time(BartBinary_path.value(), ec));
+    
+    return hash.hex();
+  }
+  
    bool BartReconGadget::check_sampling_pattern(hoNDArray< std::complex< float > >  &out_data)
   {
     size_t RO = out_data.get_size(0);
@@ -309,6 +1145,22 @@ namespace Gadgetron {
     
   }
   
+  void BartReconGadget::estimate_coil_maps(IsmrmrdReconBit& recon_bit, ReconObjType& recon_obj, size_t e)
+  {
+    if (!recon_bit.ref_)
+      return;
+    
+    // after this step, the recon_obj.ref_calib_ and recon_obj.ref_coil_map_ are set
+    if (perform_timing.value()) { gt_timer_.start("BartReconGadget::make_ref_coil_map"); }
+    this->make_ref_coil_map(*recon_bit.ref_, *recon_bit.data_.data_.get_dimensions(), recon_obj.ref_calib_, recon_obj.ref_coil_map_, e);
+    if (perform_timing.value()) { gt_timer_.stop(); }
+    
+    // after this step, coil map is computed and stored in recon_obj.coil_map_
+    if (perform_timing.value()) { gt_timer_.start("BartReconGadget::perform_coil_map_estimation"); }
+    this->perform_coil_map_estimation(recon_obj.ref_coil_map_, recon_obj.coil_map_, e);
+    if (perform_timing.value()) { gt_timer_.stop(); }
+  }
+  
   void BartReconGadget::perform_complex_coil_combine(ReconObjType& recon_obj)
   {
     try
@@ -321,9 +1173,35 @@ namespace Gadgetron {
       size_t S = recon_obj.full_kspace_.get_size(5);
       size_t SLC = recon_obj.full_kspace_.get_size(6);
       
-      recon_obj.recon_res_.data_.create(RO, E1, E2, 1, N, S, SLC);
-      Gadgetron::clear(recon_obj.recon_res_.data_);
+      std::vector<size_t> res_dims = { RO, E1, E2, 1, N, S, SLC };
+      this->create_buffer(recon_obj.recon_res_.data_, res_dims);
+      
+      std::vector<size_t> kspace_dims;
+      recon_obj.full_kspace_.get_dimensions(kspace_dims);
+      this->create_buffer(complex_im_recon_buf_, kspace_dims);
+      
+      size_t num = N*S*SLC;
+      long long ii;
+      
+      // First touch on a NUMA host: every [RO E1 E2 CHA] image and its combined image are touched by the thread
+      // that combines them, with the schedule of the combination below, so that their new pages are placed on its node.
+      // Pool buffers keep the placement of their first use, which was made the same way for the same sizes.
+      if (numa_binding.value() && (BartNumaTopology::instance().num_nodes() > 1) && (num > 1))
+      {
+	size_t im_size = RO*E1*E2*dstCHA;
+	size_t res_size = RO*E1*E2;
+	std::complex<float>* im = complex_im_recon_buf_.get_data_ptr();
+	std::complex<float>* res = recon_obj.recon_res_.data_.get_data_ptr();
+	
+	#pragma omp parallel for default(none) private(ii) shared(num, im, res, im_size, res_size) schedule(static)
+	for (ii = 0; ii < num; ii++)
+	{
+	  std::fill(im + ii*im_size, im + (ii + 1)*im_size, std::complex<float>(0.0f, 0.0f));
+	  std::fill(res + ii*res_size, res + (ii + 1)*res_size, std::complex<float>(0.0f, 0.0f));
+	}
+      }
       
+      // the fft writes all of the image buffer, the combination every [RO E1 E2] image
       if (E2>1)
       {
 	Gadgetron::hoNDFFT<float>::instance()->ifft3c(recon_obj.full_kspace_, complex_im_recon_buf_);
@@ -333,14 +1211,14 @@ namespace Gadgetron {
 	Gadgetron::hoNDFFT<float>::instance()->ifft2c(recon_obj.full_kspace_, complex_im_recon_buf_);
       }
       
-      size_t num = N*S*SLC;
-      long long ii;
+      std::vector<size_t> buf_dims = { RO, E1, E2, dstCHA };
       
-      #pragma omp parallel default(none) private(ii) shared(num, N, S, recon_obj, RO, E1, E2, dstCHA) if(num>1)
+      #pragma omp parallel default(none) private(ii) shared(num, N, S, recon_obj, RO, E1, E2, dstCHA, buf_dims) if(num>1)
       {
-	hoNDArray< std::complex<float> > complexImBuf(RO, E1, E2, dstCHA);
+	hoNDArray< std::complex<float> > complexImBuf;
+	this->create_buffer(complexImBuf, buf_dims);
 	
-	#pragma omp for
+	#pragma omp for schedule(static)
 	for (ii = 0; ii < num; ii++)
 	{
 	  size_t slc = ii / (N*S);
@@ -360,7 +1238,11 @@ namespace Gadgetron {
 	  Gadgetron::multiplyConj(complexIm, coilMap, complexImBuf);
 	  Gadgetron::sum_over_dimension(complexImBuf, combined, 3);
 	}
+	
+	this->release_buffer(complexImBuf);
       }
+      
+      this->release_buffer(complex_im_recon_buf_);
     }
     catch (...)
     {
@@ -368,5 +1250,54 @@ namespace Gadgetron {
     }
   }
   
+  size_t BartReconGadget::protocol_buffer_bytes(const ISMRMRD::IsmrmrdHeader& h)
+  {
+    if (!h.acquisitionSystemInformation || !h.acquisitionSystemInformation->receiverChannels)
+      return 0;
+    size_t CHA = h.acquisitionSystemInformation->receiverChannels.get();
+    size_t threads = static_cast<size_t>(availableCpus());
+    
+    size_t bytes = 0;
+    for (size_t e = 0; e < h.encoding.size(); e++)
+    {
+      // the encoded matrix, with its readout oversampling, is the largest the recon sees
+      size_t RO = h.encoding[e].encodedSpace.matrixSize.x;
+      size_t E1 = h.encoding[e].encodedSpace.matrixSize.y;
+      size_t E2 = h.encoding[e].encodedSpace.matrixSize.z;
+      size_t SLC = (slice_batch_size.value() == 1) ? 1 : ((slice_batch_size.value() > 0) ? std::min<size_t>(slice_batch_size.value(), num_slices_[e]) : num_slices_[e]);
+      
+      // bart output and image [RO E1 E2 CHA SLC], combined image [RO E1 E2 1 SLC], an image [RO E1 E2 CHA] per thread
+      size_t image = RO*E1*E2;
+      bytes += sizeof(std::complex<float>)*image*( SLC*(2*CHA + 1) + threads*CHA );
+    }
+    // the pool rounds every buffer up to its size class
+    return bytes + bytes/8;
+  }
+  
+  void BartReconGadget::create_buffer(hoNDArray< std::complex<float> >& a, const std::vector<size_t>& dims)
+  {
+    if (use_buffer_pool.value())
+    {
+      BartBufferPool::instance().create(a, dims);
+      return;
+    }
+    
+    std::vector<size_t> a_dims;
+    a.get_dimensions(a_dims);
+    if ( (a_dims == dims) && a.delete_data_on_destruct() )
+      return;
+    
+    // a may wrap memory it doesn't own, which must not be resized or written through
+    a.clear();
+    std::vector<size_t> new_dims(dims);
+    a.create(new_dims);
+  }
+  
+  void BartReconGadget::release_buffer(hoNDArray< std::complex<float> >& a)
+  {
+    // buffers of the pool are returned to it even if the pool has been switched off since
+    BartBufferPool::instance().release(a);
+  }
+  
   GADGET_FACTORY_DECLARE(BartReconGadget)
 }
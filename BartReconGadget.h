@@ -16,8 +16,13 @@
 #include "mri_core_data.h"
 #include <gadgetron_paths.h>
 
-#include <boost/filesystem.hpp>
-#include <boost/tokenizer.hpp>
+#include "Bart_fileio.h"
+#include "Bart_numa.h"
+#include "Bart_cache.h"
+#include "Bart_process.h"
+#include "Bart_pool.h"
+#include "Bart_warmup.h"
+#include "Bart_transport.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/tokenizer.hpp>
@@ -37,6 +42,11 @@
 #include <random>
 #include <functional>
 #include <iomanip>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <future>
+#include <memory>
 
 
 
@@ -71,155 +81,111 @@ namespace Gadgetron {
     GADGET_PROPERTY(AbsoluteBartCommandScript_path, std::string, "Absolute path to bart script(s)", get_gadgetron_home() + "/share/gadgetron/bart");
     GADGET_PROPERTY(BartCommandScript_name, std::string, "Script file containing bart command(s) to be loaded", "");
     GADGET_PROPERTY(BartWorkingDirectoryDelete, bool, "Whether to delete BartWorkingDirectory", true);
+    GADGET_PROPERTY(BartBinary_path, std::string, "Absolute path to the bart executable, exported to the script as BART", "/home/amax/bart/bart");
+    GADGET_PROPERTY(bart_timeout_s, float, "Wall clock limit of every bart step in seconds, the step is killed beyond it (0: no limit)", 0);
+    GADGET_PROPERTY(bart_omp_threads, int, "OMP_NUM_THREADS of the bart steps (0: the cores of the NUMA node the job is bound to, or all cores)", 0);
+    GADGET_PROPERTY(scratch_max_recycled, int, "Scrubbed workspaces kept for reuse per bart working directory", 2);
+    GADGET_PROPERTY(scratch_max_spare_GB, float, "Size bound of the spare staging files kept in a recycled workspace", 1);
+    
+    GADGET_PROPERTY(validate_bart_setup, bool, "Whether process_config checks that bart runs and the command script is usable, the stream doesn't start otherwise", true);
+    GADGET_PROPERTY(warmup_fft, bool, "Whether process_config starts making the FFTW plans of the image sizes of the protocol in the background, for the gadgetron FFTs of the gadget (coil maps, preview, coil combination); bart plans its own FFTs", true);
+    GADGET_PROPERTY(warmup_fft_time_limit_s, float, "Time limit of the measurement of each FFTW plan of the warm-up (0: none)", 1);
+    GADGET_PROPERTY(fftw_wisdom_file, std::string, "FFTW wisdom of the gadgetron FFTs loaded by the warm-up and updated with the new plans (default: bart_fftw_wisdom in the bart working directory)", "");
+    GADGET_PROPERTY(warmup_job, bool, "Whether process_config runs a tiny job through the command script, so that bart and its libraries are warm for the first exam", false);
     
     GADGET_PROPERTY(esp_map, int, "esp_map",2);
     GADGET_PROPERTY(n_iter_l1, int, "n_iter_l1", 15);
     GADGET_PROPERTY(lambda_l1, float, "lambda_l1", 0.002);
+    GADGET_PROPERTY(calibrate_on_reference, bool, "Whether the ESPIRiT calibration reads the ACS reference instead of the full kspace", true);
+    
+    GADGET_PROPERTY(send_preview_image, bool, "Whether to send a zero-filled coil combined preview before calling bart", false);
+    GADGET_PROPERTY(preview_image_series, int, "Image series number offset of the preview images", 100);
+    
+    GADGET_PROPERTY(numa_binding, bool, "Whether to bind every bart job and its workspace memory to one NUMA node", false);
+    GADGET_PROPERTY(numa_node, int, "NUMA node index used for the bart jobs (-1: round robin over the nodes)", -1);
+    
+    GADGET_PROPERTY(use_result_cache, bool, "Whether to reuse the results of identical recon jobs from the result cache", false);
+    GADGET_PROPERTY(result_cache_folder, std::string, "Folder of the result cache (default: bart_result_cache in the bart working directory)", "");
+    GADGET_PROPERTY(result_cache_size_GB, float, "Size bound of the result cache, least recently used results are evicted beyond it", 16);
+    
+    GADGET_PROPERTY(lambda_l1_sweep, std::string, "Parameter sweep: comma separated lambda_l1 values (empty: no sweep over lambda_l1)", "");
+    GADGET_PROPERTY(n_iter_l1_sweep, std::string, "Parameter sweep: comma separated n_iter_l1 values (empty: no sweep over n_iter_l1)", "");
+    GADGET_PROPERTY(sweep_parallel_solves, int, "Parameter sweep: maximal number of concurrent solves (0: all settings)", 0);
+    GADGET_PROPERTY(sweep_image_series, int, "Parameter sweep: image series number offset, one series per setting and encoding space", 1000);
+    
+    GADGET_PROPERTY(use_buffer_pool, bool, "Whether the kspace, image and coil combination buffers are recycled across calls instead of allocated every time", true);
+    GADGET_PROPERTY(buffer_pool_huge_pages, bool, "Whether the recycled buffers are backed by transparent huge pages", false);
+    GADGET_PROPERTY(buffer_pool_max_cached_GB, float, "Size bound of the released buffers kept for reuse, buffers beyond it are returned to the system (0: one set of recon buffers of the protocol matrix)", 0);
+    
+    GADGET_PROPERTY(slice_batch_size, int, "Number of slices reconstructed in one bart call, stacked along the bart slice dimension (1: no batching, 0: all slices of the protocol)", 1);
+    GADGET_PROPERTY(slice_batch_deadline_ms, float, "Checked when a slice arrives: a slice arriving this long or longer after the first slice of the batch starts the batch with the slices it has; there is no timer, a stalled stream keeps its slices until the next slice or its end", 2000);
+    
+    GADGET_PROPERTY(bart_transport, std::string, "Where the bart script runs: local, or remote on the bart_worker services of remote_workers", "local");
+    GADGET_PROPERTY(remote_workers, std::string, "Remote transport: bart_worker services as host:port, separated by commas", "");
+    GADGET_PROPERTY(remote_token, std::string, "Remote transport: shared secret of the bart_worker services (empty: the BART_WORKER_TOKEN environment variable)", "");
+    GADGET_PROPERTY(remote_compression, bool, "Remote transport: whether the files are zlib compressed on the wire", false);
+    GADGET_PROPERTY(remote_io_timeout_s, float, "Remote transport: limit of every connect, send and receive, a silent worker is given up after it", 30);
+    GADGET_PROPERTY(remote_retry_after_s, float, "Remote transport: time a worker that failed is tried after the others", 60);
+    GADGET_PROPERTY(remote_fallback_local, bool, "Remote transport: whether a job no worker takes runs locally", true);
     
     virtual int process_config(ACE_Message_Block* mb);
     virtual int process(GadgetContainerMessage<IsmrmrdReconData>* m1);
+    virtual int close(unsigned long flags);
     
     long long image_counter_;
     std::string workLocation_;
     // record the recon kernel, coil maps etc. for every encoding space
     std::vector< ReconObjType > recon_obj_;
     
-    // utility functions for read/write
-    std::string CreateBartFileFolder(std::string workLocation_);
-    template<typename U> void write_BART_Array(const char* filename, hoNDArray<U> *a);
-    template <class T> boost::shared_ptr< hoNDArray<T> > read_BART_Array(const char* filename);
-    std::string & getOutputFilename(const std::string & bartCommandLine);
-    void cleanup(std::string &createdFiles);
-    
+    // slices waiting for their batch
+    struct PendingSlice
+    {
+      GadgetContainerMessage<IsmrmrdReconData>* message;
+      std::chrono::steady_clock::time_point arrival;
+    };
+    std::vector<PendingSlice> pending_slices_;
+    // slices of the protocol that arrived since the last round of all slices, in any order
+    std::vector<bool> slices_arrived_;
+    // messages of the batch under recon, its images are sent back per message
+    std::vector< GadgetContainerMessage<IsmrmrdReconData>* > batch_messages_;
+    // number of slices of every encoding space in the protocol
+    std::vector<size_t> num_slices_;
+    
+    // where the bart script runs, the files of a remote job travel with it
+    std::unique_ptr<BartJobTransport> transport_;
+    bool remote_transport_;
+    
+    // the bart steps of the gadget are killed once it is set (by close, or for the sibling step of one that failed)
+    std::atomic<bool> cancel_;
+    
+    int process_recon_data(GadgetContainerMessage<IsmrmrdReconData>* m1);
+    int batch_slices(GadgetContainerMessage<IsmrmrdReconData>* m1);
+    // current is the message given to process, which is released by the caller on failure
+    int flush_slice_batch(GadgetContainerMessage<IsmrmrdReconData>* current);
+    
+    // gadgetron coil maps of the reference, for the coil combination
+    void estimate_coil_maps(IsmrmrdReconBit& recon_bit, ReconObjType& recon_obj, size_t e);
     void perform_complex_coil_combine(ReconObjType& recon_obj);
+    // pool buffers if use_buffer_pool, plain hoNDArray memory otherwise
+    void create_buffer(hoNDArray< std::complex<float> >& a, const std::vector<size_t>& dims);
+    // bart output, image and combined image of every encoding space of the protocol, for a job of one image per slice;
+    // 0 if the header doesn't tell the number of coils
+    size_t protocol_buffer_bytes(const ISMRMRD::IsmrmrdHeader& h);
+    void release_buffer(hoNDArray< std::complex<float> >& a);
+    void send_out_recon_res(IsmrmrdReconBit& recon_bit, ReconObjType& recon_obj, size_t e, int series_num, const std::string& image_comment, const std::vector< std::pair<std::string, double> >& image_meta = std::vector< std::pair<std::string, double> >());
+    void send_image_array(IsmrmrdReconBit& recon_bit, IsmrmrdImageArray& res, size_t e, int series_num, const std::string& image_comment, const std::vector< std::pair<std::string, double> >& image_meta);
+    int perform_parameter_sweep(IsmrmrdReconBit& recon_bit, ReconObjType& recon_obj, size_t e, const std::string& command_script, const std::string& folder, const std::string& input_name, const std::string& reference_name, const std::string& output_name, bool calibrated, int numa_node);
+    std::vector<std::string> reference_calibration_params(IsmrmrdReconBit& recon_bit, const std::string& reference_name);
+    // omp_threads <= 0: job_cpus; the bart process is bound to numa_node if >= 0
+    BartProcessSpec make_bart_step(const std::string& folder, int omp_threads, int numa_node = -1);
+    // cores of a bart job, those of its NUMA node when it is bound to one
+    int job_cpus(int numa_node);
+    bool run_warmup_job(const std::string& command_script, const std::string& work_location);
+    std::string compute_result_cache_key(IsmrmrdReconBit& recon_bit, ReconObjType& recon_obj, const std::string& command_script);
     
     bool check_sampling_pattern(hoNDArray< std::complex< float > >  &out_data);
 
   };
   
-  std::string BartReconGadget::CreateBartFileFolder(std::string workLocation_)
-  {
-
-    std::string outputFolderPath;
-    
-    time_t rawtime;
-    char buff[80];
-    time(&rawtime);
-    strftime(buff, sizeof(buff), "%H_%M_%S__", localtime(&rawtime));
-    std::mt19937::result_type seed = static_cast<unsigned long>(time(0));
-    auto dice_rand = std::bind(std::uniform_int_distribution<int>(1, 10000), std::mt19937(seed));
-    std::string time_id(buff + std::to_string(dice_rand()));
-    outputFolderPath = workLocation_ + "bart_" + time_id + "/";
-
-    return outputFolderPath;
-  }
-  
-  template<typename U> void BartReconGadget::write_BART_Array(const char* filename, hoNDArray<U> *a)
-  {
-    std::vector<size_t> DIMS;
-    for (int i = 0; i < a->get_number_of_dimensions(); i++)
-    {
-      DIMS.push_back(static_cast<size_t>(a->get_size(i)));
-    }
-    
-    const size_t MAX_DIMS = 16;  // BART dims 16
-    std::string filename_hdr = std::string(filename) + std::string(".hdr");
-    std::vector<size_t> v(MAX_DIMS, 1);
-    assert(DIMS.size() < MAX_DIMS);
-    std::copy(DIMS.cbegin(), DIMS.cend(), v.begin());
-    
-    std::ofstream pFile_hdr;
-    pFile_hdr.open(filename_hdr, std::ofstream::out);
-    if (!pFile_hdr.is_open())
-      GERROR("Failed to write into file: %s\n", filename);
-    pFile_hdr << "# Dimensions\n";
-    std::copy(v.cbegin(), v.cend(), std::ostream_iterator<size_t>(pFile_hdr, " "));
-    pFile_hdr.close();
-    
-    
-    std::string filename_s = std::string(filename) + std::string(".cfl");
-    std::fstream pFile(filename_s, std::ios::out | std::ios::binary);
-    if (!pFile.is_open())
-      GERROR("Failed to write into file: %s\n", filename);
-    
-    pFile.write(reinterpret_cast<char*>(a->get_data_ptr()), a->get_number_of_elements()*sizeof(U));
-    pFile.close();
-  }
-  
-  
-  template <class T> boost::shared_ptr< hoNDArray<T> > BartReconGadget::read_BART_Array(const char* filename)
-  {
-    
-    std::string filename_hdr = std::string(filename) + std::string(".hdr");
-    std::fstream infile_hdr(filename_hdr,std::ios::in | std::ios::binary);
-    
-    if (!infile_hdr.is_open())
-      GERROR("Failed to open file: %s\n", filename_hdr.c_str());
-    
-    std::vector<size_t> DIMS;
-    if (infile_hdr.is_open())
-    {
-      std::vector<std::string> tokens;
-      std::string line;
-      
-      while (std::getline(infile_hdr, line, '\n'))
-      {
-	tokens.push_back(line);
-      }
-      
-      // Parse the dimensions
-      const std::string s = tokens[1];
-      std::stringstream ss(s);
-      std::string items;
-      while (getline(ss, items, ' ')) {
-	DIMS.push_back(std::stoi(items, nullptr, 10));
-      }
-      infile_hdr.close();
-    }
-    
-    // convert from BART data of 16 dims to Gadgetron data of 7 dims
-    // BART      dim order: [RO, E1, E2, CHA, MAP, TE, COEFF, COEFF2, ITER, CShift, Time1, Time2, Level, Slice, Avg]
-    // Gadgetron dim order: [RO, E1, E2, CHA, N, S, LOC]
-    std::vector<size_t> DIMS_GT;   
-    DIMS_GT.push_back(DIMS[0]);    // RO
-    DIMS_GT.push_back(DIMS[1]);    // E1
-    DIMS_GT.push_back(DIMS[2]);    // E2
-    DIMS_GT.push_back(DIMS[3]);    // CHA
-    size_t dims_left = 1;
-    for (int iter = 4; iter < DIMS.size(); iter ++)
-      dims_left = dims_left*DIMS[iter];
-    DIMS_GT.push_back(dims_left);
-    DIMS_GT.push_back(1);
-    DIMS_GT.push_back(1);
-    
-     // Load the cfl file
-    std::string filename_s = std::string(filename) + std::string(".cfl");
-    std::fstream infile(filename_s, std::ios::in | std::ios::binary);
-    if (!infile.is_open()){
-      GERROR("Failed to open file: %s\n", filename_s.c_str());
-      return boost::shared_ptr< hoNDArray<T> >();
-    }
-    
-    boost::shared_ptr< hoNDArray<T> > out( new hoNDArray<T>(&DIMS_GT) );
-    infile.read(reinterpret_cast<char*>(out->get_data_ptr()),sizeof(T)*out->get_number_of_elements());
-    
-    return out;
-  }
-  
-  std::string & BartReconGadget::getOutputFilename(const std::string & bartCommandLine)
-  {
-    static std::vector<std::string> outputFile;
-    boost::char_separator<char> sep(" ");
-    boost::tokenizer<boost::char_separator<char> > tokens(bartCommandLine, sep);
-    for (auto itr = tokens.begin(); itr != tokens.end(); ++itr)
-      outputFile.push_back(*itr);
-    return (outputFile.back());
-  }
-  
-  void BartReconGadget::cleanup(std::string &createdFiles)
-  {
-    boost::filesystem::remove_all(createdFiles);
-  }
-
 }
 #endif //BART_RECON_GADGET_H
@@ -0,0 +1,257 @@
+/*******************************************************************
+ * Description: Streaming Geometric Coil Compression (GCC) Gadget
+ * GCC matrices are computed as soon as the ACS lines have arrived,
+ * every following readout is compressed in hybrid space as it streams in,
+ * so that the accumulation and the recon run at the compressed channel number
+ * (see BART_Recon_StreamingGcc.xml)
+ * Lang: C++
+ *******************************************************************/
+#include "BartStreamingGccGadget.h"
+#include "hoNDFFT.h"
+#include "ismrmrd/xml.h"
+
+namespace Gadgetron {
+
+  BartStreamingGccGadget::BartStreamingGccGadget()
+  {}
+
+  int BartStreamingGccGadget::process_config(ACE_Message_Block* mb)
+  {
+    ISMRMRD::IsmrmrdHeader h;
+    try
+    {
+      deserialize(mb->rd_ptr(), h);
+    }
+    catch (...)
+    {
+      GDEBUG("Error parsing ISMRMRD Header");
+      return GADGET_FAIL;
+    }
+
+    size_t NE = h.encoding.size();
+    GDEBUG_CONDITION_STREAM(verbose.value(), "Number of encoding spaces: " << NE);
+
+    // number of ACS lines to wait for before the GCC matrices are computed
+    calib_lines_.resize(NE, 1);
+    for (size_t e = 0; e < NE; e++)
+    {
+      if (CalibLines.value() > 0)
+      {
+	calib_lines_[e] = CalibLines.value();
+      }
+      else
+      {
+	bool is_3D = (h.encoding[e].encodedSpace.matrixSize.z > 1);
+	calib_lines_[e] = CalibSize.value() * (is_3D ? CalibSize.value() : 1);
+      }
+      GDEBUG_CONDITION_STREAM(verbose.value(), "Encoding space " << e << " : GCC calibration after " << calib_lines_[e] << " ACS lines");
+    }
+
+    return GADGET_OK;
+  }
+
+  int BartStreamingGccGadget::process(GadgetContainerMessage<ISMRMRD::AcquisitionHeader>* m1, GadgetContainerMessage< hoNDArray< std::complex<float> > >* m2)
+  {
+    ISMRMRD::AcquisitionHeader& acqhdr = *m1->getObjectPtr();
+    hoNDArray< std::complex<float> >& data = *m2->getObjectPtr();
+
+    size_t RO = data.get_size(0);
+    size_t CHA = data.get_size(1);
+
+    // noise lines and data that already has few channels are passed through
+    if (ISMRMRD::FlagBit(ISMRMRD::ISMRMRD_ACQ_IS_NOISE_MEASUREMENT).isSet(acqhdr.flags) || (static_cast<size_t>(DstChaNum.value()) >= CHA))
+    {
+      return this->next()->putq(m1);
+    }
+
+    GccState& state = gcc_state_[std::make_pair(acqhdr.encoding_space_ref, acqhdr.idx.slice)];
+
+    if (state.ready)
+    {
+      if ( (RO != state.RO) || (CHA != state.CHA) )
+      {
+	GWARN_STREAM("Readout [" << RO << " " << CHA << "] doesn't match the GCC calibration [" << state.RO << " " << state.CHA << "], passed through uncompressed");
+	return this->next()->putq(m1);
+      }
+
+      compress_readout(state, data);
+      acqhdr.active_channels = static_cast<uint16_t>(DstChaNum.value());
+      return this->next()->putq(m1);
+    }
+
+    // keep a hybrid space copy of every ACS line until the calibration is ready
+    bool is_acs = ISMRMRD::FlagBit(ISMRMRD::ISMRMRD_ACQ_IS_PARALLEL_CALIBRATION).isSet(acqhdr.flags)
+	       || ISMRMRD::FlagBit(ISMRMRD::ISMRMRD_ACQ_IS_PARALLEL_CALIBRATION_AND_IMAGING).isSet(acqhdr.flags);
+
+    if (state.pending.empty() && state.calib.empty())
+    {
+      state.RO = RO;
+      state.CHA = CHA;
+    }
+
+    if ( is_acs && (RO == state.RO) && (CHA == state.CHA) )
+    {
+      hoNDArray< std::complex<float> > calib_line(data);
+      Gadgetron::hoNDFFT<float>::instance()->ifft1c(calib_line);
+      state.calib.push_back(arma::cx_fmat(reinterpret_cast<std::complex<float>*>(calib_line.get_data_ptr()), RO, CHA));
+    }
+
+    state.pending.push_back(m1);
+
+    size_t e = acqhdr.encoding_space_ref;
+    size_t num_calib_lines = (e < calib_lines_.size()) ? calib_lines_[e] : calib_lines_.back();
+
+    bool is_last = ISMRMRD::FlagBit(ISMRMRD::ISMRMRD_ACQ_LAST_IN_SLICE).isSet(acqhdr.flags)
+		|| ISMRMRD::FlagBit(ISMRMRD::ISMRMRD_ACQ_LAST_IN_MEASUREMENT).isSet(acqhdr.flags);
+
+    if ( (state.calib.size() >= num_calib_lines) || is_last )
+    {
+      if (perform_timing.value()) { gt_timer_.start("BartStreamingGccGadget::compute_gcc_matrices"); }
+      compute_gcc_matrices(state);
+      if (perform_timing.value()) { gt_timer_.stop(); }
+
+      return flush_pending(state);
+    }
+
+    return GADGET_OK;
+  }
+
+  int BartStreamingGccGadget::close(unsigned long flags)
+  {
+    int ret = BaseClass::close(flags);
+
+    // slices which never reached the calibration criteria are compressed with the lines they have
+    if (flags)
+    {
+      for (auto & item : gcc_state_)
+      {
+	GccState& state = item.second;
+	if (!state.ready && !state.pending.empty())
+	{
+	  GWARN_STREAM("Slice " << item.first.second << " of encoding space " << item.first.first << " ended before the GCC calibration, " << state.calib.size() << " ACS lines are used");
+	  compute_gcc_matrices(state);
+	  if (flush_pending(state) != GADGET_OK)
+	    ret = GADGET_FAIL;
+	}
+      }
+      gcc_state_.clear();
+    }
+
+    return ret;
+  }
+
+  void BartStreamingGccGadget::compute_gcc_matrices(GccState& state)
+  {
+    size_t RO = state.RO;
+    size_t CHA = state.CHA;
+    size_t dstCHA = static_cast<size_t>(DstChaNum.value());
+
+    // without ACS lines, every buffered readout is used for the calibration
+    if (state.calib.empty())
+    {
+      for (auto m : state.pending)
+      {
+	GadgetContainerMessage< hoNDArray< std::complex<float> > >* md = AsContainerMessage< hoNDArray< std::complex<float> > >(m->cont());
+	if ( md && (md->getObjectPtr()->get_size(0) == RO) && (md->getObjectPtr()->get_size(1) == CHA) )
+	{
+	  hoNDArray< std::complex<float> > calib_line(*md->getObjectPtr());
+	  Gadgetron::hoNDFFT<float>::instance()->ifft1c(calib_line);
+	  state.calib.push_back(arma::cx_fmat(reinterpret_cast<std::complex<float>*>(calib_line.get_data_ptr()), RO, CHA));
+	}
+      }
+    }
+
+    size_t num_lines = state.calib.size();
+    size_t w = static_cast<size_t>(std::max<int>(GccWindow.value(), 0));
+    GDEBUG_CONDITION_STREAM(verbose.value(), "GCC calibration : " << num_lines << " lines, [RO CHA] = [" << RO << " " << CHA << "] -> " << dstCHA << " channels");
+
+    state.cc_mtx.resize(RO);
+
+    // compression matrix of every readout position, from the svd of the calibration lines in a small readout window
+    long long x;
+    #pragma omp parallel for default(none) private(x) shared(state, RO, CHA, dstCHA, num_lines, w)
+    for (x = 0; x < (long long)RO; x++)
+    {
+      size_t x0 = ((size_t)x > w) ? (size_t)x - w : 0;
+      size_t x1 = std::min(RO - 1, (size_t)x + w);
+
+      arma::cx_fmat C((x1 - x0 + 1)*num_lines, CHA);
+      size_t row = 0;
+      for (size_t l = 0; l < num_lines; l++)
+	for (size_t xx = x0; xx <= x1; xx++)
+	  C.row(row++) = state.calib[l].row(xx);
+
+      arma::cx_fmat U, V;
+      arma::fvec s;
+      if ( (C.n_rows >= dstCHA) && arma::svd_econ(U, s, V, C, "right") && (V.n_cols >= dstCHA) )
+	state.cc_mtx[x] = V.cols(0, dstCHA - 1);
+      else
+	state.cc_mtx[x] = arma::eye<arma::cx_fmat>(CHA, dstCHA);
+    }
+
+    // align the compression matrices along the readout, A(x) * P(x) ~ A(x-1)
+    for (size_t ro = 1; ro < RO; ro++)
+    {
+      arma::cx_fmat U, V;
+      arma::fvec s;
+      arma::cx_fmat M = state.cc_mtx[ro].t() * state.cc_mtx[ro - 1];
+      if (arma::svd(U, s, V, M))
+	state.cc_mtx[ro] = state.cc_mtx[ro] * (U * V.t());
+    }
+
+    state.calib.clear();
+    state.ready = true;
+  }
+
+  void BartStreamingGccGadget::compress_readout(GccState& state, hoNDArray< std::complex<float> >& data)
+  {
+    size_t RO = state.RO;
+    size_t CHA = state.CHA;
+    size_t dstCHA = state.cc_mtx[0].n_cols;
+
+    Gadgetron::hoNDFFT<float>::instance()->ifft1c(data);
+
+    hoNDArray< std::complex<float> > compressed(RO, dstCHA);
+    arma::cx_fmat X(reinterpret_cast<std::complex<float>*>(data.get_data_ptr()), RO, CHA, false, true);
+    arma::cx_fmat Y(reinterpret_cast<std::complex<float>*>(compressed.get_data_ptr()), RO, dstCHA, false, true);
+
+    for (size_t x = 0; x < RO; x++)
+      Y.row(x) = X.row(x) * state.cc_mtx[x];
+
+    Gadgetron::hoNDFFT<float>::instance()->fft1c(compressed);
+
+    data = compressed;
+  }
+
+  int BartStreamingGccGadget::flush_pending(GccState& state)
+  {
+    while (!state.pending.empty())
+    {
+      GadgetContainerMessage<ISMRMRD::AcquisitionHeader>* m = state.pending.front();
+      state.pending.pop_front();
+
+      GadgetContainerMessage< hoNDArray< std::complex<float> > >* md = AsContainerMessage< hoNDArray< std::complex<float> > >(m->cont());
+      if ( md && (md->getObjectPtr()->get_size(0) == state.RO) && (md->getObjectPtr()->get_size(1) == state.CHA) )
+      {
+	compress_readout(state, *md->getObjectPtr());
+	m->getObjectPtr()->active_channels = static_cast<uint16_t>(state.cc_mtx[0].n_cols);
+      }
+
+      if (this->next()->putq(m) < 0)
+      {
+	GERROR_STREAM("Put compressed readout to Q failed ... ");
+	m->release();
+	while (!state.pending.empty())
+	{
+	  state.pending.front()->release();
+	  state.pending.pop_front();
+	}
+	return GADGET_FAIL;
+      }
+    }
+
+    return GADGET_OK;
+  }
+
+  GADGET_FACTORY_DECLARE(BartStreamingGccGadget)
+}
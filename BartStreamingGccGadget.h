@@ -0,0 +1,93 @@
+/*******************************************************************
+ * Description: Streaming Geometric Coil Compression (GCC) Gadget
+ * GCC matrices are computed as soon as the ACS lines have arrived,
+ * every following readout is compressed in hybrid space as it streams in,
+ * so that the accumulation and the recon run at the compressed channel number
+ * (see BART_Recon_StreamingGcc.xml)
+ * Lang: C++
+ *******************************************************************/
+
+#ifndef BART_STREAMING_GCC_GADGET_H
+#define BART_STREAMING_GCC_GADGET_H
+
+#include "Gadget.h"
+#include "hoNDArray.h"
+#include "GadgetronTimer.h"
+#include "gadgetron_mricore_export.h"
+#include <ismrmrd/ismrmrd.h>
+#include <ismrmrd/xml.h>
+
+#include <armadillo>
+#include <complex>
+#include <list>
+#include <map>
+#include <vector>
+
+
+#if defined (WIN32)
+#ifdef __BUILD_GADGETRON_BartStreamingGccGadget__
+#define EXPORTGADGETS_BartStreamingGccGadget __declspec(dllexport)
+#else
+#define EXPORTGADGETS_BartStreamingGccGadget __declspec(dllimport)
+#endif
+#else
+#define EXPORTGADGETS_BartStreamingGccGadget
+#endif
+
+
+namespace Gadgetron {
+
+	class EXPORTGADGETS_BartStreamingGccGadget BartStreamingGccGadget : public Gadget2<ISMRMRD::AcquisitionHeader, hoNDArray< std::complex<float> > >
+	{
+
+	public:
+		GADGET_DECLARE(BartStreamingGccGadget);
+
+		typedef Gadget2<ISMRMRD::AcquisitionHeader, hoNDArray< std::complex<float> > > BaseClass;
+
+		BartStreamingGccGadget();
+		virtual ~BartStreamingGccGadget() = default;
+
+		virtual int close(unsigned long flags);
+
+	protected:
+		GADGET_PROPERTY(CalibSize, int, "Size of CalibSize", 24);
+		GADGET_PROPERTY(CalibLines, int, "Number of ACS lines to wait for before computing the GCC matrices (0: CalibSize for 2D, CalibSize*CalibSize for 3D)", 0);
+		GADGET_PROPERTY(DstChaNum, int, "Compressed Channel Number", 12);
+		GADGET_PROPERTY(GccWindow, int, "Half width of the readout window used to compute every GCC matrix", 2);
+
+		GADGET_PROPERTY(perform_timing, bool, "Whether to perform timing on some computational steps", false);
+		GADGET_PROPERTY(verbose, bool, "Whether to print more information", false);
+
+		virtual int process_config(ACE_Message_Block* mb);
+		virtual int process(GadgetContainerMessage<ISMRMRD::AcquisitionHeader>* m1, GadgetContainerMessage< hoNDArray< std::complex<float> > >* m2);
+
+		// GCC status of one slice/slab of one encoding space
+		struct GccState
+		{
+		  GccState() : ready(false), RO(0), CHA(0) {}
+
+		  bool ready;
+		  size_t RO;
+		  size_t CHA;
+		  // calibration lines in hybrid space [RO CHA]
+		  std::vector< arma::cx_fmat > calib;
+		  // aligned compression matrix [CHA DstCha] for every readout position
+		  std::vector< arma::cx_fmat > cc_mtx;
+		  // uncompressed lines waiting for the calibration
+		  std::list< GadgetContainerMessage<ISMRMRD::AcquisitionHeader>* > pending;
+		};
+
+		// (encoding space, slice) -> GCC status
+		std::map< std::pair<uint16_t, uint16_t>, GccState > gcc_state_;
+		std::vector<size_t> calib_lines_;
+
+		void compute_gcc_matrices(GccState& state);
+		void compress_readout(GccState& state, hoNDArray< std::complex<float> >& data);
+		int flush_pending(GccState& state);
+
+		GadgetronTimer gt_timer_;
+	};
+
+}
+#endif //BART_STREAMING_GCC_GADGET_H
@@ -0,0 +1,307 @@
+#include "Bart_cache.h"
+#include "log.h"
+#include "Bart_fileio.h"
+
+#include <boost/filesystem.hpp>
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Gadgetron{
+
+  namespace {
+    const size_t HASH_BLOCK_BYTES = size_t(16) << 20;
+
+    const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t P3 = 0x165667B19E3779F9ULL;
+
+    inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    inline uint64_t fmix(uint64_t k)
+    {
+      k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+      k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+      k ^= k >> 33;
+      return k;
+    }
+
+    inline uint64_t hash_round(uint64_t acc, uint64_t w) { return rotl(acc + w*P2, 31)*P1; }
+
+    // four independent lanes over 32 byte stripes, the tail is zero padded
+    void hash_block(const unsigned char* p, size_t n, uint64_t& d0, uint64_t& d1)
+    {
+      uint64_t acc[4] = { P1 + P2, P2, 0, P3 };
+      size_t stripes = n / 32;
+      for (size_t s = 0; s < stripes; s++)
+      {
+	uint64_t w[4];
+	std::memcpy(w, p + 32*s, 32);
+	for (int l = 0; l < 4; l++)
+	  acc[l] = hash_round(acc[l], w[l]);
+      }
+
+      size_t rest = n - 32*stripes;
+      if (rest > 0)
+      {
+	uint64_t w[4] = { 0, 0, 0, 0 };
+	std::memcpy(w, p + 32*stripes, rest);
+	for (int l = 0; l < 4; l++)
+	  acc[l] = hash_round(acc[l], w[l]);
+      }
+
+      d0 = fmix(rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18) + n);
+      d1 = fmix((acc[0]*P3) ^ rotl(acc[1], 29) ^ (acc[2] + P1) ^ rotl(acc[3]*P2, 41) ^ n);
+    }
+
+    std::atomic<unsigned long long> tmp_counter(0);
+  }
+
+  BartContentHash::BartContentHash() : length_(0)
+  {
+    h_[0] = P1;
+    h_[1] = P3;
+  }
+
+  void BartContentHash::update(const void* data, size_t bytes)
+  {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    long long num_blocks = static_cast<long long>((bytes + HASH_BLOCK_BYTES - 1) / HASH_BLOCK_BYTES);
+    std::vector<uint64_t> digests(2*std::max(num_blocks, 1LL), 0);
+
+    if (num_blocks <= 1)
+    {
+      hash_block(p, bytes, digests[0], digests[1]);
+    }
+    else
+    {
+      size_t block_bytes = HASH_BLOCK_BYTES;
+      long long b;
+      #pragma omp parallel for default(none) private(b) shared(p, bytes, num_blocks, block_bytes, digests)
+      for (b = 0; b < num_blocks; b++)
+      {
+	size_t offset = static_cast<size_t>(b)*block_bytes;
+	hash_block(p + offset, std::min(block_bytes, bytes - offset), digests[2*b], digests[2*b + 1]);
+      }
+    }
+
+    // block digests are folded in order
+    for (size_t b = 0; b < digests.size(); b += 2)
+    {
+      h_[0] = fmix(rotl(h_[0], 27) ^ digests[b]) + P1;
+      h_[1] = fmix(rotl(h_[1], 31) ^ digests[b + 1]) + P2;
+    }
+    length_ += bytes;
+  }
+
+  void BartContentHash::update(const std::string& s)
+  {
+    update_value(s.size());
+    update(s.data(), s.size());
+  }
+
+  bool BartContentHash::update_file(const std::string& filename)
+  {
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if (!file.is_open())
+      return false;
+    std::stringstream contents;
+    contents << file.rdbuf();
+    update(contents.str());
+    return true;
+  }
+
+  std::string BartContentHash::hex() const
+  {
+    std::ostringstream os;
+    os << std::hex << std::setfill('0') << std::setw(16) << fmix(h_[0] ^ length_) << std::setw(16) << fmix(h_[1] + length_);
+    return os.str();
+  }
+
+  BartResultCache& BartResultCache::instance()
+  {
+    static BartResultCache cache;
+    return cache;
+  }
+
+  bool BartResultCache::lookup(const std::string& folder, const std::string& key, const std::vector<size_t>& dims, hoNDArray< std::complex<float> >& res)
+  {
+    namespace fs = boost::filesystem;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::string entry = folder + key;
+    boost::system::error_code ec;
+    if (!fs::exists(entry + ".hdr", ec))
+      return false;
+
+    // the bart header folds the dims between CHA and the slices, the entry is read with the dims it was stored with
+    std::vector<size_t> stored_dims, bart_dims;
+    std::ifstream dims_file(entry + ".dims");
+    for (size_t d; dims_file >> d; )
+      stored_dims.push_back(d);
+    if ( (stored_dims != dims) || !read_BART_Dims(entry.c_str(), bart_dims) )
+    {
+      GWARN("Result cache entry %s doesn't have the dims of the recon, it is ignored\n", entry.c_str());
+      return false;
+    }
+
+    size_t num = std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>());
+    if (num != std::accumulate(bart_dims.begin(), bart_dims.end(), size_t(1), std::multiplies<size_t>()))
+    {
+      GWARN("Result cache entry %s doesn't have the size of the recon, it is ignored\n", entry.c_str());
+      return false;
+    }
+
+    size_t bytes = sizeof(std::complex<float>)*num;
+    uintmax_t size = fs::file_size(entry + ".cfl", ec);
+    if (ec || size < bytes)
+    {
+      GWARN("Incomplete result cache entry %s is ignored\n", entry.c_str());
+      return false;
+    }
+
+    std::ifstream infile(entry + ".cfl", std::ios::in | std::ios::binary);
+    res.create(dims);
+    if (!infile.read(reinterpret_cast<char*>(res.get_data_ptr()), bytes))
+    {
+      res.clear();
+      return false;
+    }
+
+    // most recently used entries are evicted last
+#ifndef _WIN32
+    ::utimensat(AT_FDCWD, (entry + ".hdr").c_str(), nullptr, 0);
+#else
+    fs::last_write_time(entry + ".hdr", std::time(nullptr), ec);
+#endif
+    return true;
+  }
+
+  bool BartResultCache::store(const std::string& folder, const std::string& key, hoNDArray< std::complex<float> >& res, size_t max_bytes)
+  {
+    namespace fs = boost::filesystem;
+
+    size_t bytes = res.get_number_of_elements()*sizeof(std::complex<float>);
+    if (bytes == 0 || bytes > max_bytes)
+      return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    boost::system::error_code ec;
+    fs::create_directories(folder, ec);
+    if (ec)
+    {
+      GWARN("Failed to create result cache folder %s\n", folder.c_str());
+      return false;
+    }
+
+    // written under a private name, the entry appears once its header is renamed in place
+    std::ostringstream tmp;
+    tmp << folder << ".tmp_" << key << "_";
+#ifndef _WIN32
+    tmp << ::getpid() << "_";
+#endif
+    tmp << tmp_counter++;
+
+    // [RO E1 E2 1 N S SLC], the slices go where the recon reads them from bart
+    bool written = (res.get_number_of_dimensions() == 7) ? write_BART_Array< std::complex<float> >(tmp.str().c_str(), &res, BART_SLICE_DIM)
+							  : write_BART_Array< std::complex<float> >(tmp.str().c_str(), &res);
+    {
+      std::vector<size_t> dims;
+      res.get_dimensions(dims);
+      std::ofstream dims_file(tmp.str() + ".dims");
+      for (size_t d : dims)
+	dims_file << d << " ";
+      dims_file.close();
+      written = written && !dims_file.fail();
+    }
+
+    std::string entry = folder + key;
+    if (written)
+      fs::rename(tmp.str() + ".cfl", entry + ".cfl", ec);
+    if (written && !ec)
+      fs::rename(tmp.str() + ".dims", entry + ".dims", ec);
+    if (written && !ec)
+      fs::rename(tmp.str() + ".hdr", entry + ".hdr", ec);
+    if (!written || ec)
+    {
+      GWARN("Failed to store result cache entry %s\n", entry.c_str());
+      fs::remove(tmp.str() + ".cfl", ec);
+      fs::remove(tmp.str() + ".dims", ec);
+      fs::remove(tmp.str() + ".hdr", ec);
+      return false;
+    }
+
+    evict(folder, max_bytes);
+    return true;
+  }
+
+  void BartResultCache::evict(const std::string& folder, size_t max_bytes)
+  {
+    namespace fs = boost::filesystem;
+
+    struct Entry
+    {
+      std::string name;
+      std::time_t used;
+      long used_ns;
+      uintmax_t bytes;
+    };
+    std::vector<Entry> entries;
+    uintmax_t total = 0;
+
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(folder, ec), end; !ec && it != end; it.increment(ec))
+    {
+      if (it->path().extension() != ".hdr" || it->path().filename().string()[0] == '.')
+	continue;
+
+      boost::system::error_code ec_entry;
+      std::string name = (it->path().parent_path() / it->path().stem()).string();
+      Entry entry;
+      entry.name = name;
+      entry.used = fs::last_write_time(it->path(), ec_entry);
+      entry.used_ns = 0;
+#ifndef _WIN32
+      struct stat st;
+      if (::stat(it->path().c_str(), &st) == 0)
+      {
+	entry.used = st.st_mtim.tv_sec;
+	entry.used_ns = st.st_mtim.tv_nsec;
+      }
+#endif
+      entry.bytes = fs::file_size(name + ".cfl", ec_entry);
+      if (ec_entry)
+	continue;
+
+      entries.push_back(entry);
+      total += entry.bytes;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b){ return (a.used < b.used) || (a.used == b.used && a.used_ns < b.used_ns); });
+
+    for (auto & entry : entries)
+    {
+      if (total <= max_bytes)
+	break;
+      fs::remove(entry.name + ".hdr", ec);
+      fs::remove(entry.name + ".cfl", ec);
+      fs::remove(entry.name + ".dims", ec);
+      total -= entry.bytes;
+      GDEBUG("Result cache entry %s evicted\n", entry.name.c_str());
+    }
+  }
+
+}
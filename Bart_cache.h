@@ -0,0 +1,68 @@
+#ifndef BART_CACHE_H
+#define BART_CACHE_H
+#pragma once
+
+#include "hoNDArray.h"
+
+#include <complex>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace Gadgetron{
+
+  // 128 bit content hash, fed incrementally.
+  // Large buffers are hashed in fixed size blocks in parallel, the digest doesn't depend on the number of threads.
+  class BartContentHash
+  {
+  public:
+    BartContentHash();
+
+    void update(const void* data, size_t bytes);
+    void update(const std::string& s);
+    template <typename T> void update_value(const T& v) { update(&v, sizeof(T)); }
+    template <typename T> void update_array(const hoNDArray<T>& a)
+    {
+      std::vector<size_t> dims;
+      a.get_dimensions(dims);
+      update_value(dims.size());
+      for (size_t d : dims)
+	update_value(d);
+      update(a.get_data_ptr(), a.get_number_of_elements()*sizeof(T));
+    }
+    // contents of a file, e.g. the bart command script
+    bool update_file(const std::string& filename);
+
+    // 32 hex digits
+    std::string hex() const;
+
+  private:
+    uint64_t h_[2];
+    uint64_t length_;
+  };
+
+  // Final recon results on local disk, addressed by the hash of everything the recon depends on.
+  // Entries are *.hdr & *.cfl pairs with the slices along BART_SLICE_DIM, next to the gadgetron dims
+  // of the array in *.dims; the oldest used entries are evicted beyond the size bound.
+  class BartResultCache
+  {
+  public:
+    static BartResultCache& instance();
+
+    // an entry stored with other dims than dims is a miss, res gets dims on a hit
+    bool lookup(const std::string& folder, const std::string& key, const std::vector<size_t>& dims, hoNDArray< std::complex<float> >& res);
+    bool store(const std::string& folder, const std::string& key, hoNDArray< std::complex<float> >& res, size_t max_bytes);
+
+  private:
+    BartResultCache() {}
+    BartResultCache(const BartResultCache&) = delete;
+    BartResultCache& operator=(const BartResultCache&) = delete;
+
+    void evict(const std::string& folder, size_t max_bytes);
+
+    std::mutex mutex_;
+  };
+
+}
+
+#endif
@@ -16,32 +16,30 @@
 #include <utility>
 #include <numeric>
 #include <cstdlib>
+#include <cctype>
 #include <ctime>
 #include <random>
 #include <functional>
 #include <iomanip>
 
-namespace Gadgetron{
-  
-  std::string CreateBartFileFolder(std::string workLocation_)
-  {
+#include "Bart_scratch.h"
 
-    std::string outputFolderPath;
-    
-    time_t rawtime;
-    char buff[80];
-    time(&rawtime);
-    strftime(buff, sizeof(buff), "%H_%M_%S__", localtime(&rawtime));
-    std::mt19937::result_type seed = static_cast<unsigned long>(time(0));
-    auto dice_rand = std::bind(std::uniform_int_distribution<int>(1, 10000), std::mt19937(seed));
-    std::string time_id(buff + std::to_string(dice_rand()));
-    outputFolderPath = workLocation_ + "bart_" + time_id + "/";
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-    return outputFolderPath;
-  }
+namespace Gadgetron{
   
+  // BART dim of the slices, the 7th (LOC) dim of Gadgetron
+  const size_t BART_SLICE_DIM = 13;
+  
+  // the LOC dim of a 7D array is written on BART dim slice_dim, which keeps the memory layout as dims 7 to 12 are 1;
+  // false if the header or the data couldn't be written completely, e.g. on a full disk
   template<typename U>
-  void write_BART_Array(const char* filename, hoNDArray<U> *a)
+  inline bool write_BART_Array(const char* filename, hoNDArray<U> *a, size_t slice_dim = 6)
   {
     std::vector<size_t> DIMS;
     for (int i = 0; i < a->get_number_of_dimensions(); i++)
@@ -53,99 +51,282 @@ namespace Gadgetron{
     std::string filename_hdr = std::string(filename) + std::string(".hdr");
     std::vector<size_t> v(MAX_DIMS, 1);
     assert(DIMS.size() < MAX_DIMS);
+    assert(slice_dim == 6 || (DIMS.size() == 7 && slice_dim < MAX_DIMS));
     std::copy(DIMS.cbegin(), DIMS.cend(), v.begin());
+    if (slice_dim != 6 && DIMS.size() == 7)
+    {
+      v[6] = 1;
+      v[slice_dim] = DIMS[6];
+    }
     
     std::ofstream pFile_hdr;
     pFile_hdr.open(filename_hdr, std::ofstream::out);
     if (!pFile_hdr.is_open())
-      GERROR("Failed to write into file: %s\n", filename);
+    {
+      GERROR("Failed to write into file: %s\n", filename_hdr.c_str());
+      return false;
+    }
     pFile_hdr << "# Dimensions\n";
     std::copy(v.cbegin(), v.cend(), std::ostream_iterator<size_t>(pFile_hdr, " "));
     pFile_hdr.close();
-    
+    if (pFile_hdr.fail())
+    {
+      GERROR("Failed to write into file: %s\n", filename_hdr.c_str());
+      return false;
+    }
     
     std::string filename_s = std::string(filename) + std::string(".cfl");
-    std::fstream pFile(filename_s, std::ios::out | std::ios::binary);
+    size_t bytes = a->get_number_of_elements()*sizeof(U);
+    
+    // write into the allocated blocks of a recycled workspace file if there is one,
+    // a file that couldn't be staged is written from scratch and fails below if there is no room for it
+    std::fstream pFile;
+    if (BartScratchArena::instance().stage_file(filename_s, bytes))
+      pFile.open(filename_s, std::ios::in | std::ios::out | std::ios::binary);
+    else
+      pFile.open(filename_s, std::ios::out | std::ios::trunc | std::ios::binary);
     if (!pFile.is_open())
-      GERROR("Failed to write into file: %s\n", filename);
+    {
+      GERROR("Failed to write into file: %s\n", filename_s.c_str());
+      return false;
+    }
     
-    pFile.write(reinterpret_cast<char*>(a->get_data_ptr()), a->get_number_of_elements()*sizeof(U));
+    pFile.write(reinterpret_cast<char*>(a->get_data_ptr()), bytes);
     pFile.close();
+    if (pFile.fail())
+    {
+      GERROR("Failed to write %zu bytes into file: %s\n", bytes, filename_s.c_str());
+      return false;
+    }
+    return true;
   }
   
-  template <class T> 
-  boost::shared_ptr< hoNDArray<T> > read_BART_Array(const char* filename)
+  // read the dimensions of a bart array and convert them to the 7D Gadgetron layout
+  inline bool read_BART_Dims(const char* filename, std::vector<size_t>& DIMS_GT)
   {
     
     std::string filename_hdr = std::string(filename) + std::string(".hdr");
     std::fstream infile_hdr(filename_hdr,std::ios::in | std::ios::binary);
     
     if (!infile_hdr.is_open())
+    {
       GERROR("Failed to open file: %s\n", filename_hdr.c_str());
+      return false;
+    }
     
     std::vector<size_t> DIMS;
-    if (infile_hdr.is_open())
+    std::vector<std::string> tokens;
+    std::string line;
+    
+    while (std::getline(infile_hdr, line, '\n'))
     {
-      std::vector<std::string> tokens;
-      std::string line;
-      
-      while (std::getline(infile_hdr, line, '\n'))
-      {
-	tokens.push_back(line);
-      }
-      
-      // Parse the dimensions
-      const std::string s = tokens[1];
-      std::stringstream ss(s);
-      std::string items;
-      while (getline(ss, items, ' ')) {
+      tokens.push_back(line);
+    }
+    infile_hdr.close();
+    
+    if (tokens.size() < 2)
+    {
+      GERROR("Failed to parse file: %s\n", filename_hdr.c_str());
+      return false;
+    }
+    
+    // Parse the dimensions
+    const std::string s = tokens[1];
+    std::stringstream ss(s);
+    std::string items;
+    while (getline(ss, items, ' ')) {
+      if (!items.empty())
 	DIMS.push_back(std::stoi(items, nullptr, 10));
-      }
-      infile_hdr.close();
     }
+    DIMS.resize(std::max<size_t>(DIMS.size(), 4), 1);
     
     // convert from BART data of 16 dims to Gadgetron data of 7 dims
     // BART      dim order: [RO, E1, E2, CHA, MAP, TE, COEFF, COEFF2, ITER, CShift, Time1, Time2, Level, Slice, Avg]
     // Gadgetron dim order: [RO, E1, E2, CHA, N, S, LOC]
-    std::vector<size_t> DIMS_GT;   
+    // the BART slices are LOC, the dims in between are folded into N
+    DIMS_GT.clear();
     DIMS_GT.push_back(DIMS[0]);    // RO
     DIMS_GT.push_back(DIMS[1]);    // E1
     DIMS_GT.push_back(DIMS[2]);    // E2
     DIMS_GT.push_back(DIMS[3]);    // CHA
-    int dims_left = 1;
-    for (int iter = 4; iter < DIMS.size(); iter ++)
-      dims_left = dims_left*DIMS[iter];
+    size_t dims_left = 1;
+    size_t slices = 1;
+    for (size_t iter = 4; iter < DIMS.size(); iter ++)
+    {
+      if (iter == BART_SLICE_DIM)
+	slices = DIMS[iter];
+      else
+	dims_left = dims_left*DIMS[iter];
+    }
+    // trailing dims after the slices would not be contiguous per slice
+    for (size_t iter = BART_SLICE_DIM + 1; iter < DIMS.size(); iter ++)
+    {
+      if (DIMS[iter] != 1)
+      {
+	dims_left = dims_left*slices;
+	slices = 1;
+	break;
+      }
+    }
     DIMS_GT.push_back(dims_left);
     DIMS_GT.push_back(1);
-    DIMS_GT.push_back(1);
+    DIMS_GT.push_back(slices);
     
-     // Load the cfl file
+    return true;
+  }
+  
+  // read filename.cfl into out, which already has the size given by read_BART_Dims
+  template <class T> 
+  inline bool read_BART_Data(const char* filename, hoNDArray<T>& out)
+  {
     std::string filename_s = std::string(filename) + std::string(".cfl");
     std::fstream infile(filename_s, std::ios::in | std::ios::binary);
     if (!infile.is_open()){
       GERROR("Failed to open file: %s\n", filename_s.c_str());
-      return boost::shared_ptr< hoNDArray<T> >();
+      return false;
+    }
+    
+    if (!infile.read(reinterpret_cast<char*>(out.get_data_ptr()),sizeof(T)*out.get_number_of_elements())){
+      GERROR("Failed to read file: %s\n", filename_s.c_str());
+      return false;
     }
+    return true;
+  }
+  
+  template <class T> 
+  inline boost::shared_ptr< hoNDArray<T> > read_BART_Array(const char* filename)
+  {
     
+    std::vector<size_t> DIMS_GT;
+    if (!read_BART_Dims(filename, DIMS_GT))
+      return boost::shared_ptr< hoNDArray<T> >();
+    
+    // Load the cfl file
     boost::shared_ptr< hoNDArray<T> > out( new hoNDArray<T>(&DIMS_GT) );
-    infile.read(reinterpret_cast<char*>(out->get_data_ptr()),sizeof(T)*out->get_number_of_elements());
+    if (!read_BART_Data(filename, *out))
+      return boost::shared_ptr< hoNDArray<T> >();
     
     return out;
   }
   
-  std::string & getOutputFilename(const std::string & bartCommandLine)
+  // map filename.cfl copy-on-write and wrap it in out, nothing is read until the data is touched;
+  // the returned mapping (address, length) has to outlive out, {nullptr, 0} on failure
+  template <class T> 
+  inline std::pair<void*, size_t> map_BART_Array(const char* filename, hoNDArray<T>& out)
+  {
+    std::vector<size_t> DIMS_GT;
+    if (!read_BART_Dims(filename, DIMS_GT))
+      return std::make_pair<void*, size_t>(nullptr, 0);
+    
+    size_t bytes = sizeof(T)*std::accumulate(DIMS_GT.begin(), DIMS_GT.end(), size_t(1), std::multiplies<size_t>());
+    
+#ifndef _WIN32
+    std::string filename_s = std::string(filename) + std::string(".cfl");
+    int fd = ::open(filename_s.c_str(), O_RDONLY);
+    if (fd < 0){
+      GERROR("Failed to open file: %s\n", filename_s.c_str());
+      return std::make_pair<void*, size_t>(nullptr, 0);
+    }
+    
+    struct stat st;
+    void* ptr = MAP_FAILED;
+    if ( (::fstat(fd, &st) == 0) && (static_cast<size_t>(st.st_size) >= bytes) && (bytes > 0) )
+      ptr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    
+    if (ptr == MAP_FAILED){
+      GERROR("Failed to map file: %s\n", filename_s.c_str());
+      return std::make_pair<void*, size_t>(nullptr, 0);
+    }
+    
+    out.create(DIMS_GT, reinterpret_cast<T*>(ptr), false);
+    return std::make_pair(ptr, bytes);
+#else
+    return std::make_pair<void*, size_t>(nullptr, 0);
+#endif
+  }
+  
+  inline void unmap_BART_Array(std::pair<void*, size_t>& mapping)
   {
-    static std::vector<std::string> outputFile;
-    boost::char_separator<char> sep(" ");
+#ifndef _WIN32
+    if (mapping.first)
+      ::munmap(mapping.first, mapping.second);
+#endif
+    mapping = std::make_pair<void*, size_t>(nullptr, 0);
+  }
+  
+  // whether a line of a bart script calls a bart tool, either through ${BART} or a bart path
+  inline bool isBartCommandLine(const std::string & scriptLine)
+  {
+    size_t first = scriptLine.find_first_not_of(" \t");
+    if ( (first == std::string::npos) || (scriptLine[first] == '#') || (scriptLine.compare(first, 4, "echo") == 0) )
+      return false;
+    return (scriptLine.find("${BART}") != std::string::npos) || (scriptLine.find("bart ") != std::string::npos);
+  }
+  
+  // last argument of the bart command of a script line, the shell operators and redirections after it
+  // (e.g. "|| exit 1", "; fi", "> log 2>&1") are not part of the command
+  inline std::string getOutputFilename(const std::string & bartCommandLine)
+  {
+    std::vector<std::string> outputFile;
+    boost::char_separator<char> sep(" \t");
     boost::tokenizer<boost::char_separator<char> > tokens(bartCommandLine, sep);
     for (auto itr = tokens.begin(); itr != tokens.end(); ++itr)
-      outputFile.push_back(*itr);
-    return (outputFile.back());
+    {
+      // "||", "out;", "out>log", "2>&1", "&>log" : the word ends at the operator, a file descriptor number isn't a word
+      std::string token = *itr;
+      size_t command_end = token.find_first_of(";&|<>");
+      if (command_end != std::string::npos)
+      {
+	bool redirection = (token[command_end] == '<') || (token[command_end] == '>');
+	token.erase(command_end);
+	if (!token.empty() && !(redirection && token.find_first_not_of("0123456789") == std::string::npos))
+	  outputFile.push_back(token);
+	break;
+      }
+      outputFile.push_back(token);
+    }
+    return outputFile.empty() ? std::string() : outputFile.back();
+  }
+  
+  // a file stem the gadgets can read back from the workspace, e.g. fakekspace, not a variable, option or path
+  inline bool isPlainFileStem(const std::string & name)
+  {
+    if (name.empty() || !(std::isalpha(static_cast<unsigned char>(name[0])) || name[0] == '_'))
+      return false;
+    for (char c : name)
+    {
+      if (!(std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '-'))
+	return false;
+    }
+    return true;
+  }
+  
+  // last bart command of a script, its last argument is the output the gadgets read back
+  inline bool getLastBartCommand(const std::string & scriptFile, std::string & lastCommand)
+  {
+    std::ifstream inputFile(scriptFile);
+    if (!inputFile.is_open())
+      return false;
+    
+    std::string scriptLine;
+    lastCommand.clear();
+    while (std::getline(inputFile, scriptLine))
+    {
+      if (isBartCommandLine(scriptLine))
+	lastCommand = scriptLine;
+    }
+    return true;
   }
   
-  void cleanup(std::string &createdFiles)
+  // hand the workspace back to the scratch arena, it is emptied and recycled asynchronously,
+  // or left on disk as it is if !delete_files
+  inline void cleanup(const std::string &createdFiles, bool delete_files = true)
   {
-    boost::filesystem::remove_all(createdFiles);
+    if (delete_files)
+      BartScratchArena::instance().release(createdFiles);
+    else
+      BartScratchArena::instance().keep(createdFiles);
   }
   
 }
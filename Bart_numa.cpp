@@ -0,0 +1,193 @@
+#include "Bart_numa.h"
+#include "log.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Gadgetron{
+
+  namespace {
+#if defined(__linux__)
+    // memory policy modes of set_mempolicy(2), called through syscall so that libnuma isn't needed
+    const int BART_MPOL_DEFAULT = 0;
+    const int BART_MPOL_BIND = 2;
+    const unsigned long BART_MAX_NUMA_NODES = 1024;
+    const size_t BART_NODEMASK_WORDS = BART_MAX_NUMA_NODES / (8*sizeof(unsigned long));
+#endif
+  }
+
+  BartNumaTopology& BartNumaTopology::instance()
+  {
+    static BartNumaTopology topology;
+    return topology;
+  }
+
+  BartNumaTopology::BartNumaTopology() : next_(0)
+  {
+    namespace fs = boost::filesystem;
+
+    boost::system::error_code ec;
+    fs::path sys_node("/sys/devices/system/node");
+    for (fs::directory_iterator it(sys_node, ec), end; !ec && it != end; it.increment(ec))
+    {
+      std::string name = it->path().filename().string();
+      if ( (name.size() < 5) || (name.compare(0, 4, "node") != 0) || !std::all_of(name.begin() + 4, name.end(), ::isdigit) )
+	continue;
+
+      std::ifstream cpulist_file((it->path() / "cpulist").string());
+      std::string cpulist;
+      if (!std::getline(cpulist_file, cpulist))
+	continue;
+
+      BartNumaNode node;
+      node.id = std::stoi(name.substr(4));
+      node.cpus = parse_cpulist(cpulist);
+      // memory-only nodes can't run jobs
+      if (!node.cpus.empty())
+	nodes_.push_back(node);
+    }
+
+    std::sort(nodes_.begin(), nodes_.end(), [](const BartNumaNode& a, const BartNumaNode& b){ return a.id < b.id; });
+
+    // no NUMA information, the whole host is one node
+    if (nodes_.empty())
+    {
+      BartNumaNode node;
+      node.id = 0;
+      for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++)
+	node.cpus.push_back(static_cast<int>(cpu));
+      nodes_.push_back(node);
+    }
+  }
+
+  size_t BartNumaTopology::next_node()
+  {
+    return (next_++) % nodes_.size();
+  }
+
+  size_t BartNumaTopology::num_cpus(int node_index) const
+  {
+    if ( (node_index < 0) || (nodes_.size() < 2) )
+      return 0;
+    return nodes_[node_index % nodes_.size()].cpus.size();
+  }
+
+  std::string BartNumaTopology::describe() const
+  {
+    std::ostringstream os;
+    os << nodes_.size() << " NUMA node" << (nodes_.size() > 1 ? "s" : "") << " :";
+    for (auto & node : nodes_)
+    {
+      os << " node" << node.id << " [";
+      // print contiguous cpus as ranges
+      for (size_t i = 0; i < node.cpus.size(); )
+      {
+	size_t j = i;
+	while ( (j + 1 < node.cpus.size()) && (node.cpus[j + 1] == node.cpus[j] + 1) )
+	  j++;
+	os << (i > 0 ? "," : "") << node.cpus[i];
+	if (j > i)
+	  os << "-" << node.cpus[j];
+	i = j + 1;
+      }
+      os << "]";
+    }
+    return os.str();
+  }
+
+  std::vector<int> BartNumaTopology::parse_cpulist(const std::string& cpulist)
+  {
+    std::vector<int> cpus;
+    std::stringstream ss(cpulist);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+      item.erase(std::remove_if(item.begin(), item.end(), ::isspace), item.end());
+      if (item.empty())
+	continue;
+
+      size_t dash = item.find('-');
+      try
+      {
+	int first = std::stoi(item.substr(0, dash));
+	int last = (dash == std::string::npos) ? first : std::stoi(item.substr(dash + 1));
+	for (int cpu = first; cpu <= last; cpu++)
+	  cpus.push_back(cpu);
+      }
+      catch (...)
+      {
+	GWARN("Can't parse cpu list item %s\n", item.c_str());
+      }
+    }
+    return cpus;
+  }
+
+  BartNumaBinding::BartNumaBinding(int node_index) : bound_(false), node_(-1)
+  {
+#if defined(__linux__)
+    BartNumaTopology& topology = BartNumaTopology::instance();
+    if ( (node_index < 0) || (topology.num_nodes() < 2) )
+      return;
+
+    const BartNumaNode& node = topology.nodes()[node_index % topology.num_nodes()];
+
+    if (sched_getaffinity(0, sizeof(old_affinity_), &old_affinity_) != 0)
+      return;
+
+    old_nodemask_.assign(BART_NODEMASK_WORDS, 0);
+    if (syscall(SYS_get_mempolicy, &old_policy_, old_nodemask_.data(), BART_MAX_NUMA_NODES, 0, 0) != 0)
+    {
+      old_policy_ = BART_MPOL_DEFAULT;
+      old_nodemask_.assign(BART_NODEMASK_WORDS, 0);
+    }
+
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    for (int cpu : node.cpus)
+      CPU_SET(cpu, &affinity);
+
+    std::vector<unsigned long> nodemask(BART_NODEMASK_WORDS, 0);
+    nodemask[node.id / (8*sizeof(unsigned long))] |= 1UL << (node.id % (8*sizeof(unsigned long)));
+
+    if (sched_setaffinity(0, sizeof(affinity), &affinity) != 0)
+    {
+      GWARN("Failed to bind thread to the cpus of NUMA node %d\n", node.id);
+      return;
+    }
+
+    if (syscall(SYS_set_mempolicy, BART_MPOL_BIND, nodemask.data(), BART_MAX_NUMA_NODES + 1) != 0)
+    {
+      GWARN("Failed to bind memory to NUMA node %d\n", node.id);
+    }
+
+    bound_ = true;
+    node_ = node.id;
+#else
+    (void)node_index;
+#endif
+  }
+
+  BartNumaBinding::~BartNumaBinding()
+  {
+#if defined(__linux__)
+    if (!bound_)
+      return;
+
+    sched_setaffinity(0, sizeof(old_affinity_), &old_affinity_);
+    if (old_policy_ == BART_MPOL_DEFAULT)
+      syscall(SYS_set_mempolicy, BART_MPOL_DEFAULT, nullptr, 0);
+    else
+      syscall(SYS_set_mempolicy, old_policy_, old_nodemask_.data(), BART_MAX_NUMA_NODES + 1);
+#endif
+  }
+
+}
@@ -0,0 +1,76 @@
+#ifndef BART_NUMA_H
+#define BART_NUMA_H
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace Gadgetron{
+
+  struct BartNumaNode
+  {
+    int id;
+    std::vector<int> cpus;
+  };
+
+  // NUMA topology of the host, read once from /sys/devices/system/node
+  class BartNumaTopology
+  {
+  public:
+    static BartNumaTopology& instance();
+
+    const std::vector<BartNumaNode>& nodes() const { return nodes_; }
+    size_t num_nodes() const { return nodes_.size(); }
+
+    // node index for the next job, round robin over the nodes of the host
+    size_t next_node();
+
+    // cpus a job bound to the node index gets, 0 if BartNumaBinding wouldn't bind it
+    size_t num_cpus(int node_index) const;
+
+    // e.g. "2 NUMA nodes : node0 [0-15,32-47] node1 [16-31,48-63]"
+    std::string describe() const;
+
+    static std::vector<int> parse_cpulist(const std::string& cpulist);
+
+  private:
+    BartNumaTopology();
+
+    std::vector<BartNumaNode> nodes_;
+    std::atomic<size_t> next_;
+  };
+
+  // Binds the cpu affinity and memory policy of the calling thread to one NUMA node until destruction.
+  // Processes started from this thread meanwhile (bart) inherit the binding, as does the page cache of the files it writes.
+  // A negative node index leaves the thread alone.
+  class BartNumaBinding
+  {
+  public:
+    explicit BartNumaBinding(int node_index);
+    ~BartNumaBinding();
+
+    bool bound() const { return bound_; }
+    int node() const { return node_; }
+
+  private:
+    BartNumaBinding(const BartNumaBinding&) = delete;
+    BartNumaBinding& operator=(const BartNumaBinding&) = delete;
+
+    bool bound_;
+    int node_;
+#if defined(__linux__)
+    cpu_set_t old_affinity_;
+    int old_policy_;
+    std::vector<unsigned long> old_nodemask_;
+#endif
+  };
+
+}
+
+#endif
@@ -0,0 +1,182 @@
+#include "Bart_pool.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace Gadgetron{
+
+  namespace {
+    // transparent huge pages are 2 MB on x86-64 and the smallest size class
+    const size_t HUGE_PAGE_BYTES = size_t(2) << 20;
+  }
+
+  BartBufferPool& BartBufferPool::instance()
+  {
+    static BartBufferPool pool;
+    return pool;
+  }
+
+  BartBufferPool::BartBufferPool() : huge_pages_(false), max_cached_bytes_(size_t(1) << 30)
+  {
+  }
+
+  BartBufferPool::~BartBufferPool()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto & c : cached_)
+      for (void* ptr : c.second)
+	unmap_buffer(ptr, c.first);
+    cached_.clear();
+  }
+
+  void BartBufferPool::configure(bool huge_pages, size_t max_cached_bytes)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    huge_pages_ = huge_pages;
+    max_cached_bytes_ = max_cached_bytes;
+  }
+
+  // sixteen classes per power of two above 32 MB, so that a buffer wastes at most 1/16 of its size
+  size_t BartBufferPool::size_class(size_t bytes)
+  {
+    size_t granule = HUGE_PAGE_BYTES;
+    while ((granule << 4) <= bytes)
+      granule <<= 1;
+    return std::max(granule, ((bytes + granule - 1) / granule) * granule);
+  }
+
+  void* BartBufferPool::map_buffer(size_t bytes)
+  {
+#ifndef _WIN32
+    if (!huge_pages_)
+    {
+      void* ptr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      return (ptr == MAP_FAILED) ? nullptr : ptr;
+    }
+
+    // huge pages need a 2 MB aligned start, the mapping is trimmed to it
+    size_t mapped = bytes + HUGE_PAGE_BYTES;
+    void* raw = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+      return nullptr;
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t aligned = (start + HUGE_PAGE_BYTES - 1) & ~(uintptr_t(HUGE_PAGE_BYTES) - 1);
+    if (aligned > start)
+      ::munmap(raw, aligned - start);
+    if (aligned + bytes < start + mapped)
+      ::munmap(reinterpret_cast<void*>(aligned + bytes), start + mapped - aligned - bytes);
+
+    void* ptr = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+    if (::madvise(ptr, bytes, MADV_HUGEPAGE) != 0)
+      GWARN("Transparent huge pages are not available for the buffer pool\n");
+#endif
+    return ptr;
+#else
+    return std::malloc(bytes);
+#endif
+  }
+
+  void BartBufferPool::unmap_buffer(void* ptr, size_t bytes)
+  {
+#ifndef _WIN32
+    ::munmap(ptr, bytes);
+#else
+    (void)bytes;
+    std::free(ptr);
+#endif
+  }
+
+  void* BartBufferPool::acquire(size_t bytes)
+  {
+    size_t cls = size_class(std::max<size_t>(bytes, 1));
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    stats_.acquired++;
+
+    void* ptr = nullptr;
+    auto c = cached_.find(cls);
+    if (c != cached_.end() && !c->second.empty())
+    {
+      ptr = c->second.back();
+      c->second.pop_back();
+      stats_.bytes_cached -= cls;
+      stats_.reused++;
+    }
+    else
+    {
+      // mapping is slow, it is done outside the lock
+      lock.unlock();
+      ptr = map_buffer(cls);
+      lock.lock();
+      if (!ptr)
+      {
+	GERROR("Buffer pool failed to map %zu bytes\n", cls);
+	throw std::bad_alloc();
+      }
+      stats_.allocated++;
+    }
+
+    in_use_[ptr] = cls;
+    stats_.bytes_in_use += cls;
+    stats_.peak_bytes_in_use = std::max(stats_.peak_bytes_in_use, stats_.bytes_in_use);
+    return ptr;
+  }
+
+  void BartBufferPool::release(void* ptr)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = in_use_.find(ptr);
+    if (it == in_use_.end())
+      return;
+
+    size_t cls = it->second;
+    in_use_.erase(it);
+    stats_.bytes_in_use -= cls;
+
+    if (stats_.bytes_cached + cls <= max_cached_bytes_)
+    {
+      cached_[cls].push_back(ptr);
+      stats_.bytes_cached += cls;
+    }
+    else
+    {
+      unmap_buffer(ptr, cls);
+      stats_.freed++;
+    }
+  }
+
+  bool BartBufferPool::owns(const void* ptr)
+  {
+    if (!ptr)
+      return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_use_.find(const_cast<void*>(ptr)) != in_use_.end();
+  }
+
+  BartBufferPoolStats BartBufferPool::stats()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+  std::string BartBufferPool::describe()
+  {
+    BartBufferPoolStats s = stats();
+    std::ostringstream os;
+    os << "acquired " << s.acquired << ", reused " << s.reused << ", mapped " << s.allocated << ", unmapped " << s.freed
+       << ", in use " << (s.bytes_in_use >> 20) << " MB, cached " << (s.bytes_cached >> 20) << " MB, peak " << (s.peak_bytes_in_use >> 20) << " MB";
+    return os.str();
+  }
+
+}
@@ -0,0 +1,99 @@
+#ifndef BART_POOL_H
+#define BART_POOL_H
+#pragma once
+
+#include "hoNDArray.h"
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Gadgetron{
+
+  struct BartBufferPoolStats
+  {
+    BartBufferPoolStats() : acquired(0), reused(0), allocated(0), freed(0), bytes_in_use(0), bytes_cached(0), peak_bytes_in_use(0) {}
+
+    size_t acquired;
+    // acquisitions served from the cache, the others mapped fresh memory
+    size_t reused;
+    size_t allocated;
+    size_t freed;
+    size_t bytes_in_use;
+    size_t bytes_cached;
+    size_t peak_bytes_in_use;
+  };
+
+  // Recycles the large buffers of the recon across calls and encoding spaces.
+  // Buffers are anonymous mappings rounded up to size classes, optionally backed by transparent huge pages.
+  // A recycled buffer keeps its pages, so it is neither faulted in nor zeroed again: its user has to write all of it.
+  class BartBufferPool
+  {
+  public:
+    static BartBufferPool& instance();
+
+    // released buffers beyond max_cached_bytes are unmapped
+    void configure(bool huge_pages, size_t max_cached_bytes);
+
+    void* acquire(size_t bytes);
+    void release(void* ptr);
+
+    // a is (re)created with dims on a pool buffer, it doesn't own the buffer
+    template <typename T> void create(hoNDArray<T>& a, const std::vector<size_t>& dims)
+    {
+      size_t num = 1;
+      for (size_t d : dims)
+	num *= d;
+
+      std::vector<size_t> a_dims;
+      a.get_dimensions(a_dims);
+      if ( (a_dims == dims) && owns(a.get_data_ptr()) )
+	return;
+
+      release(a);
+      std::vector<size_t> new_dims(dims);
+      a.create(new_dims, static_cast<T*>(acquire(num*sizeof(T))), false);
+    }
+
+    // hands the buffer of a back to the pool if it has one, a is cleared either way
+    template <typename T> void release(hoNDArray<T>& a)
+    {
+      if (owns(a.get_data_ptr()))
+	release(static_cast<void*>(a.get_data_ptr()));
+      a.clear();
+    }
+
+    bool owns(const void* ptr);
+
+    BartBufferPoolStats stats();
+    // e.g. "acquired 40, reused 36, mapped 4, unmapped 0, in use 0 MB, cached 5120 MB, peak 6144 MB"
+    std::string describe();
+
+    ~BartBufferPool();
+
+  private:
+    BartBufferPool();
+    BartBufferPool(const BartBufferPool&) = delete;
+    BartBufferPool& operator=(const BartBufferPool&) = delete;
+
+    static size_t size_class(size_t bytes);
+    void* map_buffer(size_t bytes);
+    void unmap_buffer(void* ptr, size_t bytes);
+
+    std::mutex mutex_;
+    bool huge_pages_;
+    size_t max_cached_bytes_;
+
+    // buffer -> its size class
+    std::map<void*, size_t> in_use_;
+    // size class -> released buffers
+    std::map<size_t, std::vector<void*> > cached_;
+
+    BartBufferPoolStats stats_;
+  };
+
+}
+
+#endif
@@ -0,0 +1,344 @@
+#include "Bart_process.h"
+#include "Bart_numa.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+// posix_spawn_file_actions_addchdir_np is available from glibc 2.29 on
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 29)))
+#define BART_SPAWN_ADDCHDIR 1
+#endif
+
+namespace Gadgetron{
+
+  namespace {
+    // grace period between SIGTERM and SIGKILL of a step that has to go
+    const double KILL_GRACE_S = 2.0;
+
+    double to_ms(const struct timeval& tv) { return tv.tv_sec*1000.0 + tv.tv_usec/1000.0; }
+  }
+
+  std::string BartProcessResult::describe() const
+  {
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(1);
+    if (!launched)
+      os << "not launched";
+    else if (timed_out)
+      os << "timed out";
+    else if (cancelled)
+      os << "cancelled";
+    else if (term_signal != 0)
+      os << "signal " << term_signal;
+    else
+      os << "exit " << exit_status;
+    os << ", wall " << wall_ms << " ms, user " << user_cpu_ms << " ms, sys " << sys_cpu_ms << " ms, max RSS " << max_rss_kb/1024 << " MB";
+    return os.str();
+  }
+
+  BartProcessLauncher& BartProcessLauncher::instance()
+  {
+    static BartProcessLauncher launcher;
+    return launcher;
+  }
+
+  BartProcessLauncher::~BartProcessLauncher()
+  {
+    // no bart job outlives gadgetron
+    cancel_all();
+  }
+
+  void BartProcessLauncher::cancel_all()
+  {
+#ifndef _WIN32
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int pgid : running_)
+      ::kill(-pgid, SIGKILL);
+#endif
+  }
+
+  std::string BartProcessLauncher::tail(const std::string& log_file, size_t num_lines, std::streamoff from)
+  {
+    std::ifstream log(log_file);
+    log.seekg(from);
+    std::deque<std::string> lines;
+    std::string line;
+    while (std::getline(log, line))
+    {
+      lines.push_back(line);
+      if (lines.size() > num_lines)
+	lines.pop_front();
+    }
+
+    std::ostringstream os;
+    for (auto & l : lines)
+      os << l << "\n";
+    return os.str();
+  }
+
+  BartProcessResult BartProcessLauncher::run(const BartProcessSpec& spec)
+  {
+    BartProcessResult result;
+    if (spec.argv.empty())
+      return result;
+
+#ifndef _WIN32
+    // scripts without execute permission are run by the shell, everything else directly
+    std::vector<std::string> args = spec.argv;
+    if (::access(args[0].c_str(), X_OK) != 0)
+      args.insert(args.begin(), "/bin/sh");
+
+    std::vector<char*> argv;
+    for (auto & a : args)
+      argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+
+    // environment of gadgetron with the variables of the step on top
+    std::vector<std::string> env;
+    for (char** e = environ; e && *e; e++)
+    {
+      std::string var(*e);
+      if (spec.environment.find(var.substr(0, var.find('='))) == spec.environment.end())
+	env.push_back(var);
+    }
+    for (auto & var : spec.environment)
+      env.push_back(var.first + "=" + var.second);
+
+    std::vector<char*> envp;
+    for (auto & v : env)
+      envp.push_back(const_cast<char*>(v.c_str()));
+    envp.push_back(nullptr);
+
+    int log_fd = ::open(spec.log_file.empty() ? "/dev/null" : spec.log_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0)
+    {
+      GERROR("Failed to open job log %s\n", spec.log_file.c_str());
+      return result;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, log_fd, 1);
+    posix_spawn_file_actions_adddup2(&actions, log_fd, 2);
+
+    // own process group, default signals and an empty signal mask whatever the gadgetron thread has
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigset_t mask, defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTERM);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = -1;
+    int err = 0;
+
+    // the child inherits the cpu affinity and memory policy of the thread starting it
+    std::unique_ptr<BartNumaBinding> numa_bind(new BartNumaBinding(spec.numa_node));
+
+#ifdef BART_SPAWN_ADDCHDIR
+    if (!spec.working_directory.empty())
+      posix_spawn_file_actions_addchdir_np(&actions, spec.working_directory.c_str());
+    err = posix_spawn(&pid, argv[0], &actions, &attr, argv.data(), envp.data());
+#else
+    // no chdir in the spawn actions, fork so that the working directory of gadgetron stays untouched
+    const char* working_directory = spec.working_directory.empty() ? nullptr : spec.working_directory.c_str();
+    pid = ::fork();
+    if (pid == 0)
+    {
+      ::setpgid(0, 0);
+      ::sigprocmask(SIG_SETMASK, &mask, nullptr);
+      ::signal(SIGPIPE, SIG_DFL);
+      ::signal(SIGINT, SIG_DFL);
+      ::signal(SIGTERM, SIG_DFL);
+      ::signal(SIGCHLD, SIG_DFL);
+      int null_fd = ::open("/dev/null", O_RDONLY);
+      if (null_fd >= 0)
+	::dup2(null_fd, 0);
+      ::dup2(log_fd, 1);
+      ::dup2(log_fd, 2);
+      if (working_directory && ::chdir(working_directory) != 0)
+	::_exit(127);
+      ::execve(argv[0], argv.data(), envp.data());
+      ::_exit(127);
+    }
+    err = (pid < 0) ? errno : 0;
+#endif
+
+    numa_bind.reset();
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    ::close(log_fd);
+
+    if (err != 0)
+    {
+      GERROR("Failed to start %s : %s\n", argv[0], std::strerror(err));
+      return result;
+    }
+    result.launched = true;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_.insert(pid);
+    }
+
+    // wait, polling so that timeouts and cancellation are noticed, the polling interval grows with the step
+    int status = 0;
+    struct rusage usage;
+    std::memset(&usage, 0, sizeof(usage));
+    std::chrono::milliseconds poll(1);
+    bool terminating = false;
+    bool reaped = false;
+    std::chrono::steady_clock::time_point kill_at;
+
+    while (true)
+    {
+      pid_t done = ::wait4(pid, &status, WNOHANG, &usage);
+      if (done == pid)
+      {
+	reaped = true;
+	break;
+      }
+      if (done < 0 && errno != EINTR)
+      {
+	GERROR("Failed to wait for %s : %s\n", argv[0], std::strerror(errno));
+	break;
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      double elapsed_s = std::chrono::duration<double>(now - start).count();
+
+      if (!terminating)
+      {
+	if ( (spec.timeout_s > 0) && (elapsed_s > spec.timeout_s) )
+	  result.timed_out = true;
+	if ( spec.cancel && spec.cancel->load() )
+	  result.cancelled = true;
+
+	if (result.timed_out || result.cancelled)
+	{
+	  ::kill(-pid, SIGTERM);
+	  terminating = true;
+	  kill_at = now + std::chrono::milliseconds(static_cast<long>(KILL_GRACE_S*1000));
+	}
+      }
+      else if (now > kill_at)
+      {
+	::kill(-pid, SIGKILL);
+      }
+
+      std::this_thread::sleep_for(poll);
+      poll = std::min(poll*2, std::chrono::milliseconds(50));
+    }
+
+    // the outcome of a step that couldn't be waited for is unknown, it fails and nothing of it is left running
+    if (!reaped)
+    {
+      ::kill(-pid, SIGKILL);
+      while ( (::wait4(pid, &status, 0, &usage) < 0) && (errno == EINTR) )
+	;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_.erase(pid);
+    }
+
+    result.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    result.user_cpu_ms = to_ms(usage.ru_utime);
+    result.sys_cpu_ms = to_ms(usage.ru_stime);
+    result.max_rss_kb = usage.ru_maxrss;
+
+    if (!reaped)
+      result.exit_status = -1;
+    else if (WIFEXITED(status))
+      result.exit_status = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+      result.term_signal = WTERMSIG(status);
+#else
+    GERROR("Bart steps can't be started on this platform\n");
+#endif
+
+    return result;
+  }
+
+  int availableCpus()
+  {
+#if defined(__linux__)
+    cpu_set_t affinity;
+    if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0)
+      return std::max(1, CPU_COUNT(&affinity));
+#endif
+    return static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  }
+
+  bool runBartStep(const std::string& step_name, const BartProcessSpec& spec, bool log_usage)
+  {
+    // the job log goes with the workspace, what the step wrote to it is passed on to the gadgetron log
+    std::streamoff log_start = 0;
+    if (!spec.log_file.empty())
+    {
+      std::ifstream log(spec.log_file, std::ios::ate);
+      if (log)
+	log_start = log.tellg();
+    }
+
+    BartProcessResult result = BartProcessLauncher::instance().run(spec);
+
+    if (log_usage)
+    {
+      GDEBUG("%s : %s\n", step_name.c_str(), result.describe().c_str());
+    }
+
+    std::string job_log;
+    if (!spec.log_file.empty())
+      job_log = BartProcessLauncher::tail(spec.log_file, result.ok() ? 20 : 50, log_start);
+
+    if (!result.ok())
+    {
+      GERROR("%s failed : %s\n", step_name.c_str(), result.describe().c_str());
+      if (!job_log.empty())
+      {
+	GERROR("End of job log %s :\n%s", spec.log_file.c_str(), job_log.c_str());
+      }
+      return false;
+    }
+    if (!job_log.empty())
+    {
+      GDEBUG("%s job log :\n%s", step_name.c_str(), job_log.c_str());
+    }
+    return true;
+  }
+
+}
@@ -0,0 +1,95 @@
+#ifndef BART_PROCESS_H
+#define BART_PROCESS_H
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Gadgetron{
+
+  // One bart step: the command, where it runs and what it sees
+  struct BartProcessSpec
+  {
+    BartProcessSpec() : timeout_s(0), cancel(nullptr), numa_node(-1) {}
+
+    // argv[0] is the executable, scripts without execute permission are run by /bin/sh
+    std::vector<std::string> argv;
+    std::string working_directory;
+    // set on top of the environment of gadgetron, e.g. BART and OMP_NUM_THREADS
+    std::map<std::string, std::string> environment;
+    // stdout and stderr of the step are appended to it, discarded if empty
+    std::string log_file;
+    // wall clock limit, no limit if <= 0
+    double timeout_s;
+    // the step is killed once *cancel is set
+    const std::atomic<bool>* cancel;
+    // the step and its memory are bound to this NUMA node index (see BartNumaBinding), not bound if < 0;
+    // only the process is bound, the calling thread is bound just while it starts it
+    int numa_node;
+  };
+
+  // Outcome and resource usage of a step, rusage covers the step and the processes it waited for
+  struct BartProcessResult
+  {
+    BartProcessResult() : launched(false), exit_status(-1), term_signal(0), timed_out(false), cancelled(false),
+			  wall_ms(0), user_cpu_ms(0), sys_cpu_ms(0), max_rss_kb(0) {}
+
+    bool launched;
+    // -1 if the step couldn't be waited for
+    int exit_status;
+    int term_signal;
+    bool timed_out;
+    bool cancelled;
+
+    double wall_ms;
+    double user_cpu_ms;
+    double sys_cpu_ms;
+    long max_rss_kb;
+
+    bool ok() const { return launched && !timed_out && !cancelled && (term_signal == 0) && (exit_status == 0); }
+
+    // e.g. "exit 0, wall 1520.3 ms, user 11830.0 ms, sys 210.4 ms, max RSS 2310 MB"
+    std::string describe() const;
+  };
+
+  // Starts bart steps with posix_spawn, without a shell in between, each in its own process group,
+  // so that a timed out or cancelled step is killed together with the bart tools it started
+  class BartProcessLauncher
+  {
+  public:
+    static BartProcessLauncher& instance();
+
+    BartProcessResult run(const BartProcessSpec& spec);
+
+    // kill every running step, e.g. when gadgetron shuts down
+    void cancel_all();
+
+    // last lines of a job log written from the offset from on, for the report of a step
+    static std::string tail(const std::string& log_file, size_t num_lines, std::streamoff from = 0);
+
+    ~BartProcessLauncher();
+
+  private:
+    BartProcessLauncher() {}
+    BartProcessLauncher(const BartProcessLauncher&) = delete;
+    BartProcessLauncher& operator=(const BartProcessLauncher&) = delete;
+
+    std::mutex mutex_;
+    // process groups of the running steps
+    std::set<int> running_;
+  };
+
+  // number of cpus the calling thread may run on, those of its NUMA node when the job is bound
+  int availableCpus();
+
+  // run one step, with its resource usage logged under step_name if log_usage,
+  // the end of the job log is reported if it fails
+  bool runBartStep(const std::string& step_name, const BartProcessSpec& spec, bool log_usage);
+
+}
+
+#endif
@@ -0,0 +1,310 @@
+#include "Bart_scratch.h"
+#include "log.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Gadgetron{
+
+  namespace {
+    const std::string SPARE_PREFIX = ".spare_";
+  }
+
+  BartScratchArena& BartScratchArena::instance()
+  {
+    static BartScratchArena arena;
+    return arena;
+  }
+
+  BartScratchArena::BartScratchArena() : stop_(false), max_recycled_(2), max_spare_bytes_(size_t(1) << 30), counter_(0)
+  {
+    janitor_ = std::thread(&BartScratchArena::janitor, this);
+  }
+
+  BartScratchArena::~BartScratchArena()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    if (janitor_.joinable())
+      janitor_.join();
+
+    // recycled workspaces don't outlive the process
+    boost::system::error_code ec;
+    for (auto & item : free_)
+      for (auto & workspace : item.second)
+	boost::filesystem::remove_all(workspace, ec);
+  }
+
+  std::string BartScratchArena::acquire(const std::string& root)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = free_.find(root);
+      while (it != free_.end() && !it->second.empty())
+      {
+	std::string workspace = it->second.back();
+	it->second.pop_back();
+
+	boost::system::error_code ec;
+	if (boost::filesystem::is_directory(workspace, ec))
+	{
+	  active_[workspace] = root;
+	  return workspace;
+	}
+      }
+    }
+
+    // pid + counter make the name unique in this host, the random part guards against pid reuse on shared roots
+#ifndef _WIN32
+    long pid = static_cast<long>(::getpid());
+#else
+    long pid = 0;
+#endif
+    for (int attempt = 0; attempt < 16; attempt++)
+    {
+      std::ostringstream name;
+      name << "bart_" << pid << "_" << counter_++ << "_" << boost::filesystem::unique_path("%%%%%%%%").string();
+
+      boost::filesystem::path dir = boost::filesystem::path(root) / name.str();
+      boost::system::error_code ec;
+      if (boost::filesystem::create_directories(dir, ec))
+      {
+	std::string workspace = dir.string() + "/";
+	std::lock_guard<std::mutex> lock(mutex_);
+	active_[workspace] = root;
+	return workspace;
+      }
+      if (ec)
+      {
+	GERROR("Failed to create bart workspace %s : %s\n", dir.string().c_str(), ec.message().c_str());
+	return std::string();
+      }
+    }
+
+    return std::string();
+  }
+
+  void BartScratchArena::release(const std::string& workspace)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = active_.find(workspace);
+      if (it == active_.end())
+      {
+	// not handed out by the arena, nothing to recycle
+	boost::system::error_code ec;
+	boost::filesystem::remove_all(workspace, ec);
+	return;
+      }
+      dirty_.push_back(*it);
+      active_.erase(it);
+    }
+    cond_.notify_one();
+  }
+
+  void BartScratchArena::keep(const std::string& workspace)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_.erase(workspace);
+  }
+
+  bool BartScratchArena::stage_file(const std::string& filename, size_t bytes)
+  {
+    namespace fs = boost::filesystem;
+
+    fs::path file(filename);
+    boost::system::error_code ec;
+
+    if (!fs::exists(file, ec))
+    {
+      // smallest spare large enough, otherwise the largest one
+      fs::path best;
+      uintmax_t best_size = 0;
+      for (fs::directory_iterator it(file.parent_path(), ec), end; !ec && it != end; it.increment(ec))
+      {
+	if (it->path().filename().string().compare(0, SPARE_PREFIX.size(), SPARE_PREFIX) != 0)
+	  continue;
+
+	boost::system::error_code ec_size;
+	uintmax_t size = fs::file_size(it->path(), ec_size);
+	if (ec_size)
+	  continue;
+
+	bool fits = (size >= bytes);
+	bool best_fits = (best_size >= bytes);
+	if ( best.empty() || (fits && (!best_fits || size < best_size)) || (!fits && !best_fits && size > best_size) )
+	{
+	  best = it->path();
+	  best_size = size;
+	}
+      }
+
+      if (!best.empty())
+	fs::rename(best, file, ec);
+    }
+
+#ifndef _WIN32
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+      return false;
+
+    // a file system that can't preallocate (EOPNOTSUPP, EINVAL) is no error, a full one is
+    int err = (::ftruncate(fd, static_cast<off_t>(bytes)) == 0) ? 0 : errno;
+    if (err == 0 && bytes > 0)
+      err = ::posix_fallocate(fd, 0, static_cast<off_t>(bytes));
+    ::close(fd);
+    if (err != 0 && err != EOPNOTSUPP && err != EINVAL)
+      GWARN("Failed to allocate %zu bytes for %s : %s\n", bytes, filename.c_str(), std::strerror(err));
+    return (err == 0);
+#else
+    return false;
+#endif
+  }
+
+  void BartScratchArena::set_max_recycled(size_t max_recycled)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_recycled_ = max_recycled;
+  }
+
+  void BartScratchArena::set_max_spare_bytes(size_t max_spare_bytes)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_spare_bytes_ = max_spare_bytes;
+  }
+
+  void BartScratchArena::janitor()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+      cond_.wait(lock, [this]{ return stop_ || !dirty_.empty(); });
+      if (dirty_.empty())
+	break;
+
+      std::string workspace = dirty_.front().first;
+      std::string root = dirty_.front().second;
+      dirty_.pop_front();
+
+      lock.unlock();
+      bool ok = scrub(workspace);
+      lock.lock();
+
+      std::vector<std::string>& pool = free_[root];
+      if ( ok && !stop_ && pool.size() < max_recycled_ )
+      {
+	pool.push_back(workspace);
+      }
+      else
+      {
+	lock.unlock();
+	boost::system::error_code ec;
+	boost::filesystem::remove_all(workspace, ec);
+	lock.lock();
+      }
+    }
+  }
+
+  bool BartScratchArena::scrub(const std::string& workspace)
+  {
+    namespace fs = boost::filesystem;
+
+    size_t max_spare_bytes;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      max_spare_bytes = max_spare_bytes_;
+    }
+
+    // the *.cfl files become spares, so their blocks are reused by the next staging writes;
+    // everything else goes, so that no result of this job can be picked up by the next one
+    std::vector< std::pair<uintmax_t, fs::path> > spares;
+    std::vector<fs::path> others;
+
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(workspace, ec), end; !ec && it != end; it.increment(ec))
+    {
+      boost::system::error_code ec_entry;
+      std::string name = it->path().filename().string();
+      bool is_cfl = (name.size() > 4) && (name.compare(name.size() - 4, 4, ".cfl") == 0);
+      bool is_spare = (name.compare(0, SPARE_PREFIX.size(), SPARE_PREFIX) == 0);
+      if ( (is_cfl || is_spare) && fs::is_regular_file(it->status(ec_entry)) )
+	spares.push_back(std::make_pair(fs::file_size(it->path(), ec_entry), it->path()));
+      else
+	others.push_back(it->path());
+    }
+    if (ec)
+      return false;
+
+    for (auto & p : others)
+      fs::remove_all(p, ec);
+
+    // keep the largest files within the spare budget
+    std::sort(spares.begin(), spares.end(), [](const std::pair<uintmax_t, fs::path>& a, const std::pair<uintmax_t, fs::path>& b){ return a.first > b.first; });
+
+    size_t kept_bytes = 0;
+    for (auto & spare : spares)
+    {
+      ec.clear();
+      if (kept_bytes + spare.first <= max_spare_bytes)
+      {
+	// spare names are never reused, so a rename can't overwrite another spare
+	if (spare.second.filename().string().compare(0, SPARE_PREFIX.size(), SPARE_PREFIX) != 0)
+	  fs::rename(spare.second, fs::path(workspace) / (SPARE_PREFIX + std::to_string(counter_++)), ec);
+	if (!ec)
+	{
+	  kept_bytes += spare.first;
+	  continue;
+	}
+      }
+      fs::remove(spare.second, ec);
+    }
+
+    return true;
+  }
+
+  void BartStagedHandle::add(const void* data, const BartStagedArrays& staged)
+  {
+    staged_[data] = std::shared_ptr<BartStagedArrays>(new BartStagedArrays(staged), [](BartStagedArrays* s) { release(*s); delete s; });
+  }
+
+  BartStagedArrays* BartStagedHandle::find(const void* data) const
+  {
+    auto it = staged_.find(data);
+    return (it == staged_.end()) ? nullptr : it->second.get();
+  }
+
+  void BartStagedHandle::release(BartStagedArrays& staged)
+  {
+#ifndef _WIN32
+    for (auto & mapping : staged.mappings)
+      if (mapping.first)
+	::munmap(mapping.first, mapping.second);
+#endif
+    staged.mappings.clear();
+
+    // the workspace can only be recycled after the mappings are gone
+    if (!staged.workspace.empty())
+    {
+      if (staged.delete_workspace)
+	BartScratchArena::instance().release(staged.workspace);
+      else
+	BartScratchArena::instance().keep(staged.workspace);
+    }
+    staged.workspace.clear();
+  }
+
+}
@@ -0,0 +1,108 @@
+#ifndef BART_SCRATCH_H
+#define BART_SCRATCH_H
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Gadgetron{
+
+  // Scratch workspaces for the *.hdr & *.cfl files exchanged with bart.
+  // Every job gets its own directory, unique across threads, streams and processes.
+  // Released directories are emptied by a background thread and handed out again,
+  // the blocks of their staging files are kept as spares for the next job.
+  class BartScratchArena
+  {
+  public:
+    static BartScratchArena& instance();
+
+    // unique workspace below root, with trailing '/', empty string on failure
+    std::string acquire(const std::string& root);
+
+    // hand a workspace back, it is scrubbed and recycled off the hot path
+    void release(const std::string& workspace);
+
+    // a workspace that stays on disk, e.g. for inspection, is no longer tracked
+    void keep(const std::string& workspace);
+
+    // create filename with the given size, reusing a spare file of the workspace when there is one
+    bool stage_file(const std::string& filename, size_t bytes);
+
+    // scrubbed workspaces kept per root, and bytes of spare files kept per workspace;
+    // the arena is shared by the gadgets of the process, the last setting applies
+    void set_max_recycled(size_t max_recycled);
+    void set_max_spare_bytes(size_t max_spare_bytes);
+
+    ~BartScratchArena();
+
+  private:
+    BartScratchArena();
+    BartScratchArena(const BartScratchArena&) = delete;
+    BartScratchArena& operator=(const BartScratchArena&) = delete;
+
+    void janitor();
+    bool scrub(const std::string& workspace);
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stop_;
+
+    // workspace -> root it was created in
+    std::map<std::string, std::string> active_;
+    // workspaces waiting to be scrubbed, with their root
+    std::deque< std::pair<std::string, std::string> > dirty_;
+    // root -> scrubbed workspaces ready to be handed out
+    std::map<std::string, std::vector<std::string> > free_;
+
+    size_t max_recycled_;
+    size_t max_spare_bytes_;
+    std::atomic<unsigned long long> counter_;
+
+    std::thread janitor_;
+  };
+  
+  // Arrays a bart gadget left in its workspace for the next bart gadget of the chain.
+  // The in-memory arrays passed down stream are copy-on-write mappings of the staged files.
+  struct BartStagedArrays
+  {
+    BartStagedArrays() : delete_workspace(true) {}
+    
+    std::string workspace;
+    std::string data_name;
+    std::string ref_name;
+    bool delete_workspace;
+    // (address, length) of the mappings backing the in-memory arrays
+    std::vector< std::pair<void*, size_t> > mappings;
+  };
+  
+  // Owner of the arrays a bart gadget staged, sent down stream as a continuation of the message
+  // whose arrays map the staged files: the mappings are gone and the workspaces recycled when
+  // the message is released, by whichever gadget releases it. A gadget in between that copies
+  // the arrays and drops the message leaves its copies intact. Copies of the handle share the arrays.
+  class BartStagedHandle
+  {
+  public:
+    // one per encoding space, data is the in-memory kspace mapping the staged data file
+    void add(const void* data, const BartStagedArrays& staged);
+    
+    // the arrays staged for data, nullptr if data isn't the array that was staged (e.g. it was replaced)
+    BartStagedArrays* find(const void* data) const;
+    
+    // unmap the arrays and hand the workspace back to the arena, once no array refers to the mappings
+    static void release(BartStagedArrays& staged);
+    
+  private:
+    std::map< const void*, std::shared_ptr<BartStagedArrays> > staged_;
+  };
+
+}
+
+#endif
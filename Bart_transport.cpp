@@ -0,0 +1,696 @@
+#include "Bart_transport.h"
+#include "log.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/tokenizer.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#ifdef BART_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace Gadgetron{
+
+  namespace {
+    // size of the frame header: magic, type, payload length
+    const size_t HEADER_BYTES = 16;
+
+    std::string file_name(const std::string& path)
+    {
+      size_t slash = path.find_last_of('/');
+      return (slash == std::string::npos) ? path : path.substr(slash + 1);
+    }
+
+    std::string read_file(const std::string& path)
+    {
+      std::ifstream file(path, std::ios::binary);
+      if (!file.is_open())
+	throw BartWire::Error("can't read " + path);
+      std::ostringstream os;
+      os << file.rdbuf();
+      return os.str();
+    }
+  }
+
+  bool BartLocalTransport::run(const std::string& step_name, const BartJob& job, bool log_usage)
+  {
+    return runBartStep(step_name, job.step, log_usage);
+  }
+
+  std::string BartLocalTransport::describe() const
+  {
+    return "local";
+  }
+
+  namespace BartWire
+  {
+    void Writer::u32(uint32_t v)
+    {
+      for (int i = 0; i < 4; i++)
+	data_.push_back(static_cast<char>((v >> (8*i)) & 0xff));
+    }
+
+    void Writer::u64(uint64_t v)
+    {
+      for (int i = 0; i < 8; i++)
+	data_.push_back(static_cast<char>((v >> (8*i)) & 0xff));
+    }
+
+    void Writer::f64(double v)
+    {
+      uint64_t bits;
+      std::memcpy(&bits, &v, sizeof(bits));
+      u64(bits);
+    }
+
+    void Writer::str(const std::string& s)
+    {
+      u64(s.size());
+      data_.append(s);
+    }
+
+    void Writer::bytes(const char* data, size_t num)
+    {
+      data_.append(data, num);
+    }
+
+    const char* Reader::take(size_t num)
+    {
+      if (num > remaining())
+	throw Error("truncated frame");
+      const char* p = data_.data() + pos_;
+      pos_ += num;
+      return p;
+    }
+
+    uint32_t Reader::u32()
+    {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(take(4));
+      uint32_t v = 0;
+      for (int i = 0; i < 4; i++)
+	v |= uint32_t(p[i]) << (8*i);
+      return v;
+    }
+
+    uint64_t Reader::u64()
+    {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(take(8));
+      uint64_t v = 0;
+      for (int i = 0; i < 8; i++)
+	v |= uint64_t(p[i]) << (8*i);
+      return v;
+    }
+
+    double Reader::f64()
+    {
+      uint64_t bits = u64();
+      double v;
+      std::memcpy(&v, &bits, sizeof(v));
+      return v;
+    }
+
+    std::string Reader::str()
+    {
+      uint64_t num = u64();
+      if (num > remaining())
+	throw Error("truncated frame");
+      return std::string(take(static_cast<size_t>(num)), static_cast<size_t>(num));
+    }
+
+    Channel::Channel(double timeout_s) : socket_(io_), timeout_s_(timeout_s)
+    {
+    }
+
+    // runs one asynchronous operation to its end or to the timeout, after which the connection is closed
+    void Channel::wait(const std::string& what, const std::function<void(const Handler&)>& start)
+    {
+      bool done = false;
+      boost::system::error_code result;
+      start([&](const boost::system::error_code& ec) { result = ec; done = true; });
+
+      io_.restart();
+      if (timeout_s_ > 0)
+	io_.run_for(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout_s_)));
+      else
+	io_.run();
+
+      if (!done)
+      {
+	// the handler of the operation runs with operation_aborted
+	boost::system::error_code ignored;
+	socket_.close(ignored);
+	io_.restart();
+	io_.run();
+	throw Error(what + " timed out");
+      }
+      if (result)
+	throw Error(what + " : " + result.message());
+    }
+
+    void Channel::connect(const std::string& host, const std::string& port)
+    {
+      boost::asio::ip::tcp::resolver resolver(io_);
+      boost::system::error_code ec;
+      auto endpoints = resolver.resolve(host, port, ec);
+      if (ec)
+	throw Error("can't resolve " + host + " : " + ec.message());
+
+      wait("connect to " + host + ":" + port, [&](const Handler& done)
+      {
+	boost::asio::async_connect(socket_, endpoints, [done](const boost::system::error_code& e, const boost::asio::ip::tcp::endpoint&) { done(e); });
+      });
+      socket_.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+    }
+
+    void Channel::send(uint32_t type, const std::string& payload)
+    {
+      Writer header;
+      header.u32(MAGIC);
+      header.u32(type);
+      header.u64(payload.size());
+
+      std::vector<boost::asio::const_buffer> buffers;
+      buffers.push_back(boost::asio::buffer(header.data()));
+      buffers.push_back(boost::asio::buffer(payload));
+      wait("send", [&](const Handler& done)
+      {
+	boost::asio::async_write(socket_, buffers, [done](const boost::system::error_code& e, size_t) { done(e); });
+      });
+    }
+
+    uint32_t Channel::receive(std::string& payload)
+    {
+      std::string header(HEADER_BYTES, '\0');
+      wait("receive", [&](const Handler& done)
+      {
+	boost::asio::async_read(socket_, boost::asio::buffer(&header[0], header.size()), [done](const boost::system::error_code& e, size_t) { done(e); });
+      });
+
+      Reader r(header);
+      if (r.u32() != MAGIC)
+	throw Error("not a bart frame");
+      uint32_t type = r.u32();
+      uint64_t num = r.u64();
+      if (num > MAX_FRAME_BYTES)
+	throw Error("frame of " + std::to_string(num) + " bytes refused");
+
+      payload.resize(static_cast<size_t>(num));
+      if (num > 0)
+      {
+	wait("receive", [&](const Handler& done)
+	{
+	  boost::asio::async_read(socket_, boost::asio::buffer(&payload[0], payload.size()), [done](const boost::system::error_code& e, size_t) { done(e); });
+	});
+      }
+      return type;
+    }
+
+    void Channel::close()
+    {
+      boost::system::error_code ignored;
+      socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+      socket_.close(ignored);
+    }
+
+    std::string JobRequest::encode() const
+    {
+      Writer w;
+      w.u32(VERSION);
+      w.str(token);
+      w.str(script_name);
+      w.str(script);
+      w.u32(static_cast<uint32_t>(args.size()));
+      for (auto & a : args)
+	w.str(a);
+      w.u32(static_cast<uint32_t>(environment.size()));
+      for (auto & var : environment)
+      {
+	w.str(var.first);
+	w.str(var.second);
+      }
+      w.f64(timeout_s);
+      w.u32(compress ? 1 : 0);
+      w.u32(static_cast<uint32_t>(outputs.size()));
+      for (auto & o : outputs)
+	w.str(o);
+      return w.data();
+    }
+
+    JobRequest JobRequest::decode(const std::string& payload)
+    {
+      Reader r(payload);
+      if (r.u32() != VERSION)
+	throw Error("job of another protocol version");
+
+      JobRequest job;
+      job.token = r.str();
+      job.script_name = r.str();
+      job.script = r.str();
+      for (uint32_t n = r.u32(); n > 0; n--)
+	job.args.push_back(r.str());
+      for (uint32_t n = r.u32(); n > 0; n--)
+      {
+	std::string name = r.str();
+	job.environment[name] = r.str();
+      }
+      job.timeout_s = r.f64();
+      job.compress = (r.u32() != 0);
+      for (uint32_t n = r.u32(); n > 0; n--)
+	job.outputs.push_back(r.str());
+      return job;
+    }
+
+    std::string encode_result(const BartProcessResult& result, const std::string& log, const std::string& worker_name)
+    {
+      Writer w;
+      w.u32(result.launched ? 1 : 0);
+      w.u32(static_cast<uint32_t>(result.exit_status));
+      w.u32(static_cast<uint32_t>(result.term_signal));
+      w.u32(result.timed_out ? 1 : 0);
+      w.u32(result.cancelled ? 1 : 0);
+      w.f64(result.wall_ms);
+      w.f64(result.user_cpu_ms);
+      w.f64(result.sys_cpu_ms);
+      w.u64(static_cast<uint64_t>(result.max_rss_kb));
+      w.str(log);
+      w.str(worker_name);
+      return w.data();
+    }
+
+    BartProcessResult decode_result(const std::string& payload, std::string& log, std::string& worker_name)
+    {
+      Reader r(payload);
+      BartProcessResult result;
+      result.launched = (r.u32() != 0);
+      result.exit_status = static_cast<int>(r.u32());
+      result.term_signal = static_cast<int>(r.u32());
+      result.timed_out = (r.u32() != 0);
+      result.cancelled = (r.u32() != 0);
+      result.wall_ms = r.f64();
+      result.user_cpu_ms = r.f64();
+      result.sys_cpu_ms = r.f64();
+      result.max_rss_kb = static_cast<long>(r.u64());
+      log = r.str();
+      worker_name = r.str();
+      return result;
+    }
+
+    std::string encode_ping(const std::string& token)
+    {
+      Writer w;
+      w.u32(VERSION);
+      w.str(token);
+      return w.data();
+    }
+
+    bool authorized(const std::string& payload, const std::string& token)
+    {
+      std::string client_token;
+      try
+      {
+	Reader r(payload);
+	if (r.u32() != VERSION)
+	  return false;
+	client_token = r.str();
+      }
+      catch (const Error&)
+      {
+	return false;
+      }
+
+      // compared in a time independent of where the secrets differ
+      if (token.empty() || (client_token.size() != token.size()))
+	return false;
+      unsigned char diff = 0;
+      for (size_t i = 0; i < token.size(); i++)
+	diff |= static_cast<unsigned char>(client_token[i] ^ token[i]);
+      return (diff == 0);
+    }
+
+    std::string encode_pong(uint32_t running, uint32_t slots, const std::string& worker_name)
+    {
+      Writer w;
+      w.u32(VERSION);
+      w.u32(running);
+      w.u32(slots);
+      w.str(worker_name);
+      return w.data();
+    }
+
+    void decode_pong(const std::string& payload, uint32_t& version, uint32_t& running, uint32_t& slots, std::string& worker_name)
+    {
+      Reader r(payload);
+      version = r.u32();
+      running = r.u32();
+      slots = r.u32();
+      worker_name = r.str();
+    }
+
+    bool compression_available()
+    {
+#ifdef BART_WITH_ZLIB
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    void send_file(Channel& channel, const std::string& path, const std::string& name, bool compress)
+    {
+      std::ifstream file(path, std::ios::binary | std::ios::ate);
+      if (!file.is_open())
+	throw Error("can't read " + path);
+      uint64_t size = static_cast<uint64_t>(file.tellg());
+      file.seekg(0);
+
+      Writer begin;
+      begin.str(name);
+      begin.u64(size);
+      channel.send(FILE_BEGIN, begin.data());
+
+      std::string raw(BLOCK_BYTES, '\0');
+      std::string packed;
+      for (uint64_t sent = 0; sent < size; )
+      {
+	size_t num = static_cast<size_t>(std::min<uint64_t>(BLOCK_BYTES, size - sent));
+	if (!file.read(&raw[0], num))
+	  throw Error("can't read " + path);
+
+	Writer block;
+	bool packed_block = false;
+#ifdef BART_WITH_ZLIB
+	// zero filled kspace packs well, noise doesn't and is sent as it is
+	if (compress)
+	{
+	  uLongf packed_size = compressBound(static_cast<uLong>(num));
+	  packed.resize(packed_size);
+	  if ( (compress2(reinterpret_cast<Bytef*>(&packed[0]), &packed_size, reinterpret_cast<const Bytef*>(raw.data()), static_cast<uLong>(num), Z_BEST_SPEED) == Z_OK)
+	       && (packed_size < num) )
+	  {
+	    block.u32(BLOCK_ZLIB);
+	    block.u64(num);
+	    block.bytes(packed.data(), packed_size);
+	    packed_block = true;
+	  }
+	}
+#else
+	(void)compress;
+#endif
+	if (!packed_block)
+	{
+	  block.u32(0);
+	  block.u64(num);
+	  block.bytes(raw.data(), num);
+	}
+	channel.send(FILE_DATA, block.data());
+	sent += num;
+      }
+    }
+
+    std::string receive_file(Channel& channel, const std::string& begin_payload, const std::string& folder)
+    {
+      Reader begin(begin_payload);
+      std::string name = begin.str();
+      uint64_t size = begin.u64();
+      if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos)
+	throw Error("file name " + name + " refused");
+
+      std::string path = folder + name;
+      std::ofstream file(path, std::ios::binary | std::ios::trunc);
+      if (!file.is_open())
+	throw Error("can't write " + path);
+
+      std::string payload, raw;
+      for (uint64_t received = 0; received < size; )
+      {
+	if (channel.receive(payload) != FILE_DATA)
+	  throw Error("file " + name + " is incomplete");
+
+	Reader block(payload);
+	uint32_t flags = block.u32();
+	uint64_t num = block.u64();
+	if ( (num > BLOCK_BYTES) || (received + num > size) )
+	  throw Error("block of file " + name + " is too large");
+
+	if (flags & BLOCK_ZLIB)
+	{
+#ifdef BART_WITH_ZLIB
+	  raw.resize(static_cast<size_t>(num));
+	  uLongf raw_size = static_cast<uLongf>(num);
+	  if ( (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &raw_size, reinterpret_cast<const Bytef*>(block.rest()), static_cast<uLong>(block.remaining())) != Z_OK)
+	       || (raw_size != num) )
+	    throw Error("block of file " + name + " doesn't unpack");
+	  file.write(raw.data(), raw.size());
+#else
+	  throw Error("file " + name + " is compressed, zlib isn't available");
+#endif
+	}
+	else
+	{
+	  if (block.remaining() != num)
+	    throw Error("block of file " + name + " is truncated");
+	  file.write(block.rest(), block.remaining());
+	}
+	if (!file)
+	  throw Error("can't write " + path);
+	received += num;
+      }
+      return name;
+    }
+  }
+
+  BartRemoteTransport::BartRemoteTransport(const std::string& workers, const std::string& token, bool compress, double io_timeout_s, double retry_after_s, bool fallback_local)
+    : token_(token), compress_(compress), io_timeout_s_(io_timeout_s), retry_after_s_(retry_after_s), fallback_local_(fallback_local), next_worker_(0)
+  {
+    boost::char_separator<char> sep(", ;");
+    boost::tokenizer<boost::char_separator<char> > tokens(workers, sep);
+    for (auto & token : tokens)
+    {
+      size_t colon = token.find_last_of(':');
+      if (colon == std::string::npos || colon == 0 || colon + 1 == token.size())
+      {
+	GWARN("Remote bart worker %s is ignored, host:port expected\n", token.c_str());
+	continue;
+      }
+      BartRemoteWorker worker;
+      worker.host = token.substr(0, colon);
+      worker.port = token.substr(colon + 1);
+      workers_.push_back(worker);
+    }
+
+    if (compress_ && !BartWire::compression_available())
+    {
+      GWARN("Remote bart jobs are sent uncompressed, gadgetron_bart is built without zlib\n");
+      compress_ = false;
+    }
+  }
+
+  std::string BartRemoteTransport::describe() const
+  {
+    std::ostringstream os;
+    os << "remote on";
+    for (auto & w : workers_)
+      os << " " << w.host << ":" << w.port;
+    if (compress_)
+      os << ", compressed";
+    return os.str();
+  }
+
+  BartProcessResult BartRemoteTransport::run_on(const BartRemoteWorker& worker, const BartJob& job, std::string& worker_name)
+  {
+    BartWire::Channel channel(io_timeout_s_);
+    channel.connect(worker.host, worker.port);
+
+    // health check: the worker answers, speaks this protocol and has a free slot
+    std::string payload;
+    channel.send(BartWire::PING, BartWire::encode_ping(token_));
+    uint32_t answer = channel.receive(payload);
+    if (answer == BartWire::FAILURE)
+      throw BartWire::Error("refused: " + BartWire::Reader(payload).str());
+    if (answer != BartWire::PONG)
+      throw BartWire::Error("no answer to PING");
+    uint32_t version, running, slots;
+    BartWire::decode_pong(payload, version, running, slots, worker_name);
+    if (version != BartWire::VERSION)
+      throw BartWire::Error("protocol version " + std::to_string(version));
+    if (running >= slots)
+      throw BartWire::Busy("all " + std::to_string(slots) + " job slots are busy");
+
+    BartWire::JobRequest request;
+    request.token = token_;
+    request.script_name = file_name(job.step.argv[0]);
+    request.script = read_file(job.step.argv[0]);
+    request.args.assign(job.step.argv.begin() + 1, job.step.argv.end());
+    // the bart binary and the cores are those of the worker
+    request.environment = job.step.environment;
+    request.environment.erase("BART");
+    request.environment.erase("OMP_NUM_THREADS");
+    request.timeout_s = job.step.timeout_s;
+    request.compress = compress_;
+    request.outputs = job.outputs;
+
+    channel.send(BartWire::JOB, request.encode());
+    for (auto & name : job.inputs)
+      BartWire::send_file(channel, job.step.working_directory + name, name, compress_);
+    channel.send(BartWire::JOB_END, std::string());
+
+    // heartbeats while the job runs, so that io_timeout_s_ applies to a silent worker and not to the job
+    BartProcessResult result;
+    bool has_result = false;
+    while (true)
+    {
+      uint32_t type = channel.receive(payload);
+      if (type == BartWire::HEARTBEAT)
+      {
+	if (job.step.cancel && job.step.cancel->load())
+	{
+	  // the worker kills the job once the connection is gone
+	  channel.close();
+	  result.launched = true;
+	  result.cancelled = true;
+	  return result;
+	}
+      }
+      else if (type == BartWire::FAILURE)
+      {
+	// the slots of the worker filled up between PING and JOB
+	std::string failure = BartWire::Reader(payload).str();
+	if (failure == BartWire::BUSY_FAILURE)
+	  throw BartWire::Busy(failure);
+	throw BartWire::Error(failure);
+      }
+      else if (type == BartWire::RESULT && !has_result)
+      {
+	std::string log;
+	result = BartWire::decode_result(payload, log, worker_name);
+	has_result = true;
+	if (!job.step.log_file.empty())
+	{
+	  std::ofstream log_file(job.step.log_file, std::ios::app);
+	  log_file << log;
+	}
+      }
+      else if (type == BartWire::FILE_BEGIN && has_result)
+      {
+	BartWire::receive_file(channel, payload, job.step.working_directory);
+      }
+      else if (type == BartWire::JOB_END && has_result)
+      {
+	break;
+      }
+      else
+      {
+	throw BartWire::Error("unexpected frame " + std::to_string(type));
+      }
+    }
+    channel.close();
+    return result;
+  }
+
+  bool BartRemoteTransport::run(const std::string& step_name, const BartJob& job, bool log_usage)
+  {
+    if (job.step.argv.empty())
+      return false;
+
+    // a missing file is no reason to try another worker
+    for (auto & name : job.inputs)
+    {
+      if (!boost::filesystem::exists(job.step.working_directory + name))
+      {
+	GERROR("%s : input %s is missing in %s\n", step_name.c_str(), name.c_str(), job.step.working_directory.c_str());
+	return false;
+      }
+    }
+
+    // the workers in turn, those that failed lately last; every worker is tried once
+    std::vector<size_t> order;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto now = std::chrono::steady_clock::now();
+      for (int down = 0; down < 2; down++)
+      {
+	for (size_t k = 0; k < workers_.size(); k++)
+	{
+	  size_t w = (next_worker_ + k) % workers_.size();
+	  if ((workers_[w].down_until > now) == (down == 1))
+	    order.push_back(w);
+	}
+      }
+      if (!workers_.empty())
+	next_worker_ = (next_worker_ + 1) % workers_.size();
+    }
+
+    for (size_t w : order)
+    {
+      BartRemoteWorker worker;
+      {
+	std::lock_guard<std::mutex> lock(mutex_);
+	worker = workers_[w];
+      }
+
+      BartProcessResult result;
+      std::string worker_name = worker.host;
+      std::streamoff log_start = 0;
+      if (!job.step.log_file.empty())
+      {
+	std::ifstream log(job.step.log_file, std::ios::ate);
+	if (log)
+	  log_start = log.tellg();
+      }
+      try
+      {
+	result = this->run_on(worker, job, worker_name);
+      }
+      catch (const BartWire::Busy& busy)
+      {
+	// a full worker is up, it is asked again for the next job
+	GDEBUG("%s : bart worker %s:%s is busy, %s\n", step_name.c_str(), worker.host.c_str(), worker.port.c_str(), busy.what());
+	continue;
+      }
+      catch (const BartWire::Error& error)
+      {
+	GWARN("%s : bart worker %s:%s failed, %s\n", step_name.c_str(), worker.host.c_str(), worker.port.c_str(), error.what());
+	std::lock_guard<std::mutex> lock(mutex_);
+	workers_[w].down_until = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(retry_after_s_));
+	continue;
+      }
+
+      {
+	std::lock_guard<std::mutex> lock(mutex_);
+	workers_[w].down_until = std::chrono::steady_clock::time_point();
+      }
+
+      if (log_usage)
+      {
+	GDEBUG("%s on %s : %s\n", step_name.c_str(), worker_name.c_str(), result.describe().c_str());
+      }
+      if (!result.ok())
+      {
+	GERROR("%s failed on %s : %s\n", step_name.c_str(), worker_name.c_str(), result.describe().c_str());
+	if (!job.step.log_file.empty())
+	{
+	  GERROR("End of job log %s :\n%s", job.step.log_file.c_str(), BartProcessLauncher::tail(job.step.log_file, 50, log_start).c_str());
+	}
+	return false;
+      }
+      if (!job.step.log_file.empty())
+      {
+	GDEBUG("%s job log :\n%s", step_name.c_str(), BartProcessLauncher::tail(job.step.log_file, 20, log_start).c_str());
+      }
+      return true;
+    }
+
+    if (fallback_local_)
+    {
+      GWARN("%s : no remote bart worker took the job, it runs locally\n", step_name.c_str());
+      return runBartStep(step_name, job.step, log_usage);
+    }
+    GERROR("%s : no remote bart worker took the job\n", step_name.c_str());
+    return false;
+  }
+
+}
@@ -0,0 +1,236 @@
+#ifndef BART_TRANSPORT_H
+#define BART_TRANSPORT_H
+#pragma once
+
+#include "Bart_process.h"
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Gadgetron{
+
+  // One bart job: the step as it would run locally, with the files of its working directory
+  // it reads and those it writes, so that it can run somewhere else
+  struct BartJob
+  {
+    BartProcessSpec step;
+    // names in step.working_directory, e.g. input_data.hdr and input_data.cfl
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+  };
+
+  // Where the bart jobs run; the outputs are in the working directory of the job afterwards either way
+  class BartJobTransport
+  {
+  public:
+    virtual ~BartJobTransport() {}
+
+    // reported like runBartStep, false if the job failed or couldn't run
+    virtual bool run(const std::string& step_name, const BartJob& job, bool log_usage) = 0;
+    virtual std::string describe() const = 0;
+  };
+
+  // the job is a process of this node working on its files in place
+  class BartLocalTransport : public BartJobTransport
+  {
+  public:
+    virtual bool run(const std::string& step_name, const BartJob& job, bool log_usage);
+    virtual std::string describe() const;
+  };
+
+  // Frames between BartRemoteTransport and bart_worker: magic, type, payload length (little endian), payload.
+  // A job is JOB, its input files, JOB_END; the worker sends HEARTBEAT while the job runs, then RESULT,
+  // the output files and JOB_END, or FAILURE if it doesn't take the job.
+  // A file is FILE_BEGIN (name, size) and FILE_DATA blocks (flags, raw size, bytes), each block zlib compressed on request.
+  // PING and JOB start with the protocol version and the shared secret of the worker, which drops a client without it.
+  namespace BartWire
+  {
+    const uint32_t MAGIC = 0x54524142;
+    const uint32_t VERSION = 2;
+
+    enum FrameType
+    {
+      PING = 1,
+      PONG,
+      JOB,
+      FILE_BEGIN,
+      FILE_DATA,
+      JOB_END,
+      HEARTBEAT,
+      RESULT,
+      FAILURE
+    };
+
+    // file contents go in blocks of this size, a larger frame is refused
+    const size_t BLOCK_BYTES = size_t(4) << 20;
+    const uint64_t MAX_FRAME_BYTES = 2*BLOCK_BYTES;
+    const uint32_t BLOCK_ZLIB = 1;
+
+    // the peer is the problem: timeout, closed connection, malformed frame
+    class Error : public std::runtime_error
+    {
+    public:
+      explicit Error(const std::string& what) : std::runtime_error(what) {}
+    };
+
+    // the worker is fine but all its job slots are taken, the job goes to the next one
+    class Busy : public Error
+    {
+    public:
+      explicit Busy(const std::string& what) : Error(what) {}
+    };
+
+    // FAILURE text of a worker refusing a job for want of a free slot
+    const char* const BUSY_FAILURE = "all job slots are busy";
+
+    class Writer
+    {
+    public:
+      void u32(uint32_t v);
+      void u64(uint64_t v);
+      void f64(double v);
+      void str(const std::string& s);
+      void bytes(const char* data, size_t num);
+      const std::string& data() const { return data_; }
+
+    private:
+      std::string data_;
+    };
+
+    // throws Error when the payload is shorter than what is read from it
+    class Reader
+    {
+    public:
+      explicit Reader(const std::string& data) : data_(data), pos_(0) {}
+
+      uint32_t u32();
+      uint64_t u64();
+      double f64();
+      std::string str();
+      const char* rest() const { return data_.data() + pos_; }
+      size_t remaining() const { return data_.size() - pos_; }
+
+    private:
+      const char* take(size_t num);
+
+      const std::string& data_;
+      size_t pos_;
+    };
+
+    // A TCP connection on which every connect, send and receive has to finish within the timeout
+    class Channel
+    {
+    public:
+      // no limit if timeout_s <= 0
+      explicit Channel(double timeout_s);
+
+      boost::asio::ip::tcp::socket& socket() { return socket_; }
+      void set_timeout(double timeout_s) { timeout_s_ = timeout_s; }
+
+      void connect(const std::string& host, const std::string& port);
+      void send(uint32_t type, const std::string& payload);
+      uint32_t receive(std::string& payload);
+      void close();
+
+    private:
+      typedef std::function<void(const boost::system::error_code&)> Handler;
+      void wait(const std::string& what, const std::function<void(const Handler&)>& start);
+
+      boost::asio::io_context io_;
+      boost::asio::ip::tcp::socket socket_;
+      double timeout_s_;
+    };
+
+    // JOB payload
+    struct JobRequest
+    {
+      JobRequest() : timeout_s(0), compress(false) {}
+
+      // shared secret of the worker
+      std::string token;
+      // the script is run by /bin/sh in the job folder of the worker, under its own name
+      std::string script_name;
+      std::string script;
+      std::vector<std::string> args;
+      std::map<std::string, std::string> environment;
+      double timeout_s;
+      // whether the outputs are sent back compressed
+      bool compress;
+      std::vector<std::string> outputs;
+
+      std::string encode() const;
+      static JobRequest decode(const std::string& payload);
+    };
+
+    // RESULT payload: the outcome of the job, the end of its log and the worker that ran it
+    std::string encode_result(const BartProcessResult& result, const std::string& log, const std::string& worker_name);
+    BartProcessResult decode_result(const std::string& payload, std::string& log, std::string& worker_name);
+
+    // PING payload: protocol version and shared secret
+    std::string encode_ping(const std::string& token);
+
+    // whether the PING or JOB payload starts with this protocol version and the given shared secret,
+    // checked before anything else of the payload is used
+    bool authorized(const std::string& payload, const std::string& token);
+
+    // PONG payload: protocol version, running jobs and job slots of the worker
+    std::string encode_pong(uint32_t running, uint32_t slots, const std::string& worker_name);
+    void decode_pong(const std::string& payload, uint32_t& version, uint32_t& running, uint32_t& slots, std::string& worker_name);
+
+    bool compression_available();
+
+    void send_file(Channel& channel, const std::string& path, const std::string& name, bool compress);
+    // the file announced by the FILE_BEGIN payload is written into folder, its name is returned;
+    // names with a path are refused
+    std::string receive_file(Channel& channel, const std::string& begin_payload, const std::string& folder);
+  }
+
+  struct BartRemoteWorker
+  {
+    std::string host;
+    std::string port;
+    // a worker that failed is tried after the others until then
+    std::chrono::steady_clock::time_point down_until;
+  };
+
+  // Runs the jobs on bart_worker services of other nodes: the script, its arguments and the input files go over the wire,
+  // the output files come back into the working directory. The job goes to the next worker in turn that answers a PING
+  // and has a free slot; if the worker can't be reached, is full or drops the connection, the job is tried on the next one.
+  // A job that ran and failed on its worker isn't tried again. BART and OMP_NUM_THREADS are those of the worker.
+  class BartRemoteTransport : public BartJobTransport
+  {
+  public:
+    // workers as "host:port,host:port" sharing the secret token, the job runs locally if none takes it and fallback_local
+    BartRemoteTransport(const std::string& workers, const std::string& token, bool compress, double io_timeout_s, double retry_after_s, bool fallback_local);
+
+    virtual bool run(const std::string& step_name, const BartJob& job, bool log_usage);
+    virtual std::string describe() const;
+
+    size_t num_workers() const { return workers_.size(); }
+
+  private:
+    // throws BartWire::Error when the worker doesn't take or doesn't finish the job
+    BartProcessResult run_on(const BartRemoteWorker& worker, const BartJob& job, std::string& worker_name);
+
+    std::vector<BartRemoteWorker> workers_;
+    std::string token_;
+    bool compress_;
+    double io_timeout_s_;
+    double retry_after_s_;
+    bool fallback_local_;
+
+    std::mutex mutex_;
+    size_t next_worker_;
+  };
+
+}
+
+#endif
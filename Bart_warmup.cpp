@@ -0,0 +1,226 @@
+#include "hoNDArray.h"
+#include "log.h"
+#include "Bart_fileio.h"
+#include "Bart_process.h"
+#include "Bart_warmup.h"
+
+#include <fftw3.h>
+
+#include <chrono>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Gadgetron{
+
+  namespace {
+    // limit of "bart version" if the gadget has no step timeout
+    const double VALIDATE_TIMEOUT_S = 30.0;
+  }
+
+  BartWarmup& BartWarmup::instance()
+  {
+    static BartWarmup warmup;
+    return warmup;
+  }
+
+  BartWarmup::BartWarmup()
+  {
+    // the fft planning of the warm-up may run next to the transforms of a stream already reconstructing
+    fftwf_make_planner_thread_safe();
+  }
+
+  BartWarmup::~BartWarmup()
+  {
+    for (auto & planner : planners_)
+      planner.join();
+  }
+
+  void BartWarmup::read_ahead(const std::string& file)
+  {
+#ifndef _WIN32
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    ::close(fd);
+#endif
+  }
+
+  bool BartWarmup::validate(const std::string& bart_binary, const std::string& command_script, double timeout_s)
+  {
+    std::string key = bart_binary + "\n" + command_script;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (validated_.count(key))
+	return true;
+    }
+
+#ifndef _WIN32
+    if (::access(bart_binary.c_str(), X_OK) != 0)
+    {
+      GERROR("Bart binary %s is missing or not executable\n", bart_binary.c_str());
+      return false;
+    }
+#endif
+
+    if (!command_script.empty())
+    {
+      std::string last_command;
+      if (!getLastBartCommand(command_script, last_command))
+      {
+	GERROR("Can't read bart commands script: %s\n", command_script.c_str());
+	return false;
+      }
+      // the gadget reads back <output>.cfl/.hdr from the workspace, the last bart command must write it itself
+      std::string output = getOutputFilename(last_command);
+      if (!isPlainFileStem(output))
+      {
+	GERROR("Bart commands script %s has no bart command writing the output (last command: %s)\n", command_script.c_str(), last_command.c_str());
+	return false;
+      }
+      std::string command = last_command.substr(0, last_command.rfind(output));
+      boost::char_separator<char> sep(" \t");
+      boost::tokenizer<boost::char_separator<char> > tokens(command, sep);
+      if (std::find(tokens.begin(), tokens.end(), output) != tokens.end())
+      {
+	GERROR("Bart commands script %s reads its output %s in the command writing it\n", command_script.c_str(), output.c_str());
+	return false;
+      }
+      read_ahead(command_script);
+    }
+    read_ahead(bart_binary);
+
+    // loads bart and its libraries into the page cache as well
+    BartProcessSpec spec;
+    spec.argv = { bart_binary, "version" };
+    spec.timeout_s = (timeout_s > 0) ? timeout_s : VALIDATE_TIMEOUT_S;
+    BartProcessResult result = BartProcessLauncher::instance().run(spec);
+    if (!result.ok())
+    {
+      GERROR("Bart binary %s doesn't run : %s\n", bart_binary.c_str(), result.describe().c_str());
+      return false;
+    }
+    GDEBUG("Bart binary %s checked : %s\n", bart_binary.c_str(), result.describe().c_str());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    validated_.insert(key);
+    return true;
+  }
+
+  void BartWarmup::prepare_fft(const std::vector< std::vector<size_t> >& image_sizes, const std::string& wisdom_file, double time_limit_s)
+  {
+    // off the process_config path: the first exam may start before its plans are made, it plans them itself then;
+    // a planner is started for the sizes no stream has asked for yet
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector< std::vector<size_t> > new_sizes;
+    for (auto & size : image_sizes)
+    {
+      if (fft_requested_.insert(size).second)
+	new_sizes.push_back(size);
+    }
+    if (!new_sizes.empty())
+      planners_.push_back(std::thread(&BartWarmup::plan_fft, this, new_sizes, wisdom_file, time_limit_s));
+  }
+
+  void BartWarmup::plan_fft(const std::vector< std::vector<size_t> >& image_sizes, const std::string& wisdom_file, double time_limit_s)
+  {
+    std::lock_guard<std::mutex> lock(fft_mutex_);
+
+    if (!wisdom_file.empty() && !wisdom_loaded_.count(wisdom_file))
+    {
+      if (fftwf_import_wisdom_from_filename(wisdom_file.c_str()))
+	GDEBUG("FFTW wisdom loaded from %s\n", wisdom_file.c_str());
+      wisdom_loaded_.insert(wisdom_file);
+    }
+
+    // the measurements are cut short after time_limit_s, the plan is the best one found until then
+    fftwf_set_timelimit((time_limit_s > 0) ? time_limit_s : FFTW_NO_TIMELIMIT);
+    auto start = std::chrono::steady_clock::now();
+    size_t num_planned = 0;
+    for (auto & size : image_sizes)
+    {
+      // fftw is row major, the slowest dimension first; singleton dimensions are left out as in a 2D recon
+      std::vector<int> n;
+      size_t num = 1;
+      for (auto d = size.rbegin(); d != size.rend(); ++d)
+      {
+	if (*d > 1)
+	{
+	  n.push_back(static_cast<int>(*d));
+	  num *= *d;
+	}
+      }
+      if (n.empty())
+	continue;
+
+      // in place, both directions; the contents of the buffer are overwritten by the measurements
+      fftwf_complex* buf = fftwf_alloc_complex(num);
+      if (!buf)
+	continue;
+      for (int sign : { FFTW_FORWARD, FFTW_BACKWARD })
+      {
+	fftwf_plan plan = fftwf_plan_dft(static_cast<int>(n.size()), n.data(), buf, buf, sign, FFTW_MEASURE);
+	if (plan)
+	  fftwf_destroy_plan(plan);
+      }
+      fftwf_free(buf);
+      num_planned++;
+    }
+    fftwf_set_timelimit(FFTW_NO_TIMELIMIT);
+
+    if (num_planned == 0)
+      return;
+
+    GDEBUG("FFTW plans of %d image size(s) made in %.1f ms\n", (int)num_planned, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+    // written aside and renamed, so that another gadgetron never reads half of it
+    if (!wisdom_file.empty())
+    {
+      std::string tmp_file = wisdom_file + ".tmp." + std::to_string(::getpid());
+      if (fftwf_export_wisdom_to_filename(tmp_file.c_str()) && (std::rename(tmp_file.c_str(), wisdom_file.c_str()) == 0))
+	GDEBUG("FFTW wisdom saved to %s\n", wisdom_file.c_str());
+      else
+      {
+	GWARN("Failed to save FFTW wisdom to %s\n", wisdom_file.c_str());
+	std::remove(tmp_file.c_str());
+      }
+    }
+  }
+
+  bool BartWarmup::run_once(const std::string& key, const std::function<bool()>& job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (jobs_done_.count(key))
+	return true;
+    }
+
+    if (!job())
+      return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_done_.insert(key);
+    return true;
+  }
+
+  std::vector< std::vector<size_t> > headerImageSizes(const ISMRMRD::IsmrmrdHeader& h)
+  {
+    std::vector< std::vector<size_t> > sizes;
+    for (auto & encoding : h.encoding)
+    {
+      size_t RO = encoding.encodedSpace.matrixSize.x;
+      size_t E1 = encoding.encodedSpace.matrixSize.y;
+      size_t E2 = encoding.encodedSpace.matrixSize.z;
+      sizes.push_back({ RO, E1, E2 });
+      // the data reaching the bart gadgets usually has its readout oversampling removed
+      if (RO > encoding.reconSpace.matrixSize.x)
+	sizes.push_back({ RO / 2, E1, E2 });
+    }
+    return sizes;
+  }
+
+}
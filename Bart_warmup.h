@@ -0,0 +1,59 @@
+#ifndef BART_WARMUP_H
+#define BART_WARMUP_H
+#pragma once
+
+#include <ismrmrd/xml.h>
+
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Gadgetron{
+
+  // One-off preparation of the bart setup from process_config, so that the first exam after a restart
+  // neither pays for cold binaries and fft plans nor finds a broken setup half way through
+  class BartWarmup
+  {
+  public:
+    static BartWarmup& instance();
+
+    // bart starts ("bart version") within timeout_s and the command script, if any, has a bart command writing the output;
+    // both files are read ahead into the page cache, a setup that passed isn't checked again
+    bool validate(const std::string& bart_binary, const std::string& command_script, double timeout_s);
+
+    // fftw plans of the [RO E1 E2] image sizes, measured once per process on top of the wisdom of wisdom_file,
+    // which is updated with the new plans; the planning runs in the background, at most time_limit_s per plan.
+    // The wisdom is that of the fftw in gadgetron (hoNDFFT), the bart processes plan on their own
+    void prepare_fft(const std::vector< std::vector<size_t> >& image_sizes, const std::string& wisdom_file, double time_limit_s);
+
+    // run job once per key, e.g. a tiny bart job per binary and script, again later if it failed
+    bool run_once(const std::string& key, const std::function<bool()>& job);
+
+  private:
+    BartWarmup();
+    ~BartWarmup();
+    BartWarmup(const BartWarmup&) = delete;
+    BartWarmup& operator=(const BartWarmup&) = delete;
+
+    static void read_ahead(const std::string& file);
+    void plan_fft(const std::vector< std::vector<size_t> >& image_sizes, const std::string& wisdom_file, double time_limit_s);
+
+    std::mutex mutex_;
+    // the fft planning is serialized on its own, the other warm-ups don't wait for it
+    std::mutex fft_mutex_;
+    std::vector<std::thread> planners_;
+    std::set< std::vector<size_t> > fft_requested_;
+    std::set<std::string> validated_;
+    std::set<std::string> wisdom_loaded_;
+    std::set<std::string> jobs_done_;
+  };
+
+  // [RO E1 E2] of the encoding spaces of the header, RO with and without the readout oversampling
+  std::vector< std::vector<size_t> > headerImageSizes(const ISMRMRD::IsmrmrdHeader& h);
+
+}
+
+#endif
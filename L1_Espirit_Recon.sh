@@ -5,11 +5,19 @@ ESPMAP=3
 CALIB=24
 THRESH=0.002
 NITER=15
+CALIB_ONLY=0
+MAPS=
+REF=
+MAPDIMS=
+
+# bart binary, the gadget exports the one it is configured with
+BART=${BART:-/home/amax/bart/bart}
+SCRIPT=$(readlink -f "$0")
 
 echo "----    Arguments   ----"
 echo " $# arguments : $@"
 
-while getopts "r:k:m:w:i:d" opt; do
+while getopts "r:k:m:w:i:dCM:R:D:" opt; do
 	case $opt in
 	r)
 		CALIB=$OPTARG
@@ -31,6 +39,22 @@ while getopts "r:k:m:w:i:d" opt; do
                 NITER=$OPTARG
                 echo "PICS iteration number:${NITER}"
 	;;
+	C)
+		CALIB_ONLY=1
+                echo "ESPIRiT calibration only"
+	;;
+	M)
+		MAPS=$(readlink -f "$OPTARG")
+                echo "ESPIRiT maps         :${MAPS}"
+	;;
+	R)
+		REF=$(readlink -f "$OPTARG")
+                echo "ACS reference        :${REF}"
+	;;
+	D)
+		MAPDIMS=$OPTARG
+                echo "ESPIRiT map size     :${MAPDIMS}"
+	;;
 	\?)
 		echo "Invalid option       : -$OPTARG" >&2
 	;;
@@ -46,11 +70,75 @@ fi
 
 kspace=$(readlink -f "$1")
 
+# slices batched by the gadget along the bart slice dimension (13) are reconstructed
+# one after the other, every one in its own folder, and joined again
+# (a calibration on the reference with the map size given may run before the kspace is written)
+NSLICES=$(${BART} show -d13 ${REF:-${kspace}})
+if [ ${NSLICES} -gt 1 ] ; then
+	echo "---- ${NSLICES} slices ----"
+	OPTS="-r ${CALIB} -k ${KRN} -m ${ESPMAP} -w ${THRESH} -i ${NITER}"
+	if [ ${CALIB_ONLY} -eq 1 ] ; then
+		OPTS="${OPTS} -C"
+	fi
+	if [ -n "${MAPDIMS}" ] ; then
+		OPTS="${OPTS} -D ${MAPDIMS}"
+	fi
+	SLICE_MAPS=
+	SLICE_OUT=
+	s=0
+	while [ $s -lt ${NSLICES} ] ; do
+		mkdir -p slice_$s
+		if [ ${CALIB_ONLY} -eq 0 ] || [ -z "${REF}" ] || [ -z "${MAPDIMS}" ] ; then
+			${BART} slice 13 $s ${kspace} slice_$s/kspace || exit 1
+		fi
+		SLICE_OPTS="${OPTS}"
+		if [ -n "${REF}" ] ; then
+			${BART} slice 13 $s ${REF} slice_$s/reference || exit 1
+			SLICE_OPTS="${SLICE_OPTS} -R reference"
+		fi
+		if [ -n "${MAPS}" ] ; then
+			${BART} slice 13 $s ${MAPS} slice_$s/shared_maps || exit 1
+			SLICE_OPTS="${SLICE_OPTS} -M shared_maps"
+		fi
+		( cd slice_$s && /bin/sh "${SCRIPT}" ${SLICE_OPTS} kspace ) || exit 1
+		SLICE_MAPS="${SLICE_MAPS} slice_$s/maps"
+		SLICE_OUT="${SLICE_OUT} slice_$s/fakekspace"
+		s=$((s+1))
+	done
+	if [ -z "${MAPS}" ] ; then
+		${BART} join 13 ${SLICE_MAPS} maps || exit 1
+	fi
+	if [ ${CALIB_ONLY} -eq 0 ] ; then
+		${BART} join 13 ${SLICE_OUT} fakekspace || exit 1
+	fi
+	exit 0
+fi
+
 echo "---- Reconstruction ----"
 
-echo "----Step 1: ESPIRiT Calibration               ----"
-/home/amax/bart/bart ecalib -r${CALIB} -k${KRN} -m${ESPMAP} -S -t0.0005 -c0.9 ${kspace} maps
+# maps of an earlier calibration (-M) are shared by several solves
+if [ -z "${MAPS}" ] ; then
+	echo "----Step 1: ESPIRiT Calibration               ----"
+	if [ -n "${REF}" ] ; then
+		# calibration reads only the compact ACS reference, the maps are computed at the size of the kspace
+		${BART} ecalib -1 -r${CALIB} -k${KRN} -t0.0005 ${REF} calib_table || exit 1
+		if [ -n "${MAPDIMS}" ] ; then
+			MAPSIZE=$(echo ${MAPDIMS} | tr ':' ' ')
+		else
+			MAPSIZE="$(${BART} show -d0 ${kspace}) $(${BART} show -d1 ${kspace}) $(${BART} show -d2 ${kspace})"
+		fi
+		${BART} ecaltwo -m${ESPMAP} -S -c0.9 ${MAPSIZE} calib_table maps || exit 1
+	else
+		${BART} ecalib -r${CALIB} -k${KRN} -m${ESPMAP} -S -t0.0005 -c0.9 ${kspace} maps || exit 1
+	fi
+	MAPS=maps
+fi
+
+if [ ${CALIB_ONLY} -eq 1 ] ; then
+	exit 0
+fi
+
 echo "----Step 2: L1-SENSE Reconstruciton on GPU    ----"
-/home/amax/bart/bart pics -S -l1 -r${THRESH} -i${NITER} ${kspace} maps ims_soft_sense
+${BART} pics -S -l1 -r${THRESH} -i${NITER} ${kspace} ${MAPS} ims_soft_sense || exit 1
 echo "----Step 3: Fake kspace with Data consistency ----"
-/home/amax/bart/bart fakeksp -r ims_soft_sense ${kspace} maps fakekspace
+${BART} fakeksp -r ims_soft_sense ${kspace} ${MAPS} fakekspace || exit 1
@@ -0,0 +1,436 @@
+/*******************************************************************
+ * Description: Deterministic stand-in for the bart binary
+ * Simulates the bart tools called by the gadgets and L1_Espirit_Recon.sh
+ * (cc, ccapply, ecalib, ecaltwo, pics, fakeksp, show, slice, join),
+ * so that the recon chains can be replayed and timed without a real bart.
+ * Outputs have the dimensions bart would produce, their contents are a
+ * cheap deterministic function of the inputs.
+ *
+ * Compute cost : every tool sweeps its input a number of times,
+ *   BART_STUB_COST       scales the sweeps of all tools (default 1.0)
+ *   BART_STUB_COST_<TOOL> scales one tool, e.g. BART_STUB_COST_PICS=4
+ * Lang: C++
+ *******************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+  typedef std::complex<float> cfloat;
+  const size_t BART_DIMS = 16;
+
+  struct Array
+  {
+    std::vector<size_t> dims;
+    std::vector<cfloat> data;
+
+    Array() : dims(BART_DIMS, 1) {}
+    explicit Array(const std::vector<size_t>& d) : dims(d) { dims.resize(BART_DIMS, 1); data.resize(size()); }
+
+    size_t size() const { return std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>()); }
+    // number of elements of one [RO E1 E2] volume
+    size_t volume() const { return dims[0]*dims[1]*dims[2]; }
+    // number of elements above the coil dimension
+    size_t batches() const { return size() / (volume()*dims[3]); }
+  };
+
+  bool read_cfl(const std::string& name, Array& a)
+  {
+    std::ifstream hdr(name + ".hdr");
+    std::string line;
+    if (!std::getline(hdr, line) || !std::getline(hdr, line))
+    {
+      std::cerr << "bart stub: can't read " << name << ".hdr" << std::endl;
+      return false;
+    }
+
+    std::istringstream ss(line);
+    a.dims.clear();
+    size_t d;
+    while (ss >> d)
+      a.dims.push_back(d);
+    a.dims.resize(BART_DIMS, 1);
+    a.data.resize(a.size());
+
+    std::ifstream cfl(name + ".cfl", std::ios::binary);
+    if (!cfl.read(reinterpret_cast<char*>(a.data.data()), a.data.size()*sizeof(cfloat)))
+    {
+      std::cerr << "bart stub: can't read " << name << ".cfl" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool write_cfl(const std::string& name, const Array& a)
+  {
+    std::ofstream hdr(name + ".hdr");
+    hdr << "# Dimensions\n";
+    std::copy(a.dims.begin(), a.dims.end(), std::ostream_iterator<size_t>(hdr, " "));
+    hdr << "\n";
+
+    std::ofstream cfl(name + ".cfl", std::ios::binary);
+    cfl.write(reinterpret_cast<const char*>(a.data.data()), a.data.size()*sizeof(cfloat));
+    return bool(hdr) && bool(cfl);
+  }
+
+  double cost_scale(const std::string& tool)
+  {
+    double scale = 1.0;
+    if (const char* c = std::getenv("BART_STUB_COST"))
+      scale = std::atof(c);
+
+    std::string name = "BART_STUB_COST_" + tool;
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if (const char* c = std::getenv(name.c_str()))
+      scale = std::atof(c);
+
+    return std::max(0.0, scale);
+  }
+
+  // deterministic compute load, result folded into the output so it can't be optimized out
+  float burn(const Array& a, const std::string& tool, double passes)
+  {
+    size_t n = static_cast<size_t>(std::lround(passes*cost_scale(tool)));
+    float acc = 0.0f;
+    for (size_t p = 0; p < n; p++)
+      for (size_t i = 0; i < a.data.size(); i++)
+	acc = std::fma(std::abs(a.data[i]), 1e-30f, acc);
+    return acc;
+  }
+
+  // options taking a separate value when given as "-x value"
+  struct Args
+  {
+    std::vector<std::string> positional;
+    std::vector< std::pair<char, std::string> > options;
+
+    Args(int argc, char** argv, const std::string& valued)
+    {
+      for (int i = 2; i < argc; i++)
+      {
+	std::string arg = argv[i];
+	// "-1" is a flag (ecalib -1), longer "-<digit>..." arguments are negative numbers
+	if ( (arg.size() >= 2) && (arg[0] == '-') && (!std::isdigit(arg[1]) || arg.size() == 2) )
+	{
+	  std::string value = arg.substr(2);
+	  if (value.empty() && (valued.find(arg[1]) != std::string::npos) && (i + 1 < argc))
+	    value = argv[++i];
+	  options.push_back(std::make_pair(arg[1], value));
+	}
+	else
+	{
+	  positional.push_back(arg);
+	}
+      }
+    }
+
+    std::string get(char opt, const std::string& def) const
+    {
+      for (auto & o : options)
+	if (o.first == opt)
+	  return o.second;
+      return def;
+    }
+
+    bool has(char opt) const
+    {
+      for (auto & o : options)
+	if (o.first == opt)
+	  return true;
+      return false;
+    }
+  };
+
+  int usage(const std::string& tool, size_t num)
+  {
+    std::cerr << "bart stub: " << tool << " expects " << num << " file arguments" << std::endl;
+    return 1;
+  }
+
+  // cc : identity compression matrix [1 1 1 CHA CHA]
+  int tool_cc(const Args& args)
+  {
+    if (args.positional.size() != 2) return usage("cc", 2);
+    Array ksp;
+    if (!read_cfl(args.positional[0], ksp)) return 1;
+
+    size_t CHA = ksp.dims[3];
+    Array mtx(std::vector<size_t>{1, 1, 1, CHA, CHA});
+    for (size_t c = 0; c < CHA; c++)
+      mtx.data[c*CHA + c] = 1.0f + burn(ksp, "cc", 1);
+
+    return write_cfl(args.positional[1], mtx) ? 0 : 1;
+  }
+
+  // ccapply : keeps the first p channels
+  int tool_ccapply(const Args& args)
+  {
+    if (args.positional.size() != 3) return usage("ccapply", 3);
+    Array ksp, mtx;
+    if (!read_cfl(args.positional[0], ksp) || !read_cfl(args.positional[1], mtx)) return 1;
+
+    size_t CHA = ksp.dims[3];
+    size_t dstCHA = std::min<size_t>(CHA, std::atoi(args.get('p', std::to_string(CHA)).c_str()));
+    float f = burn(ksp, "ccapply", 1);
+
+    std::vector<size_t> dims = ksp.dims;
+    dims[3] = dstCHA;
+    Array out(dims);
+    size_t vol = ksp.volume();
+    for (size_t b = 0; b < ksp.batches(); b++)
+      for (size_t c = 0; c < dstCHA; c++)
+	for (size_t i = 0; i < vol; i++)
+	  out.data[(b*dstCHA + c)*vol + i] = ksp.data[(b*CHA + c)*vol + i] + f;
+
+    return write_cfl(args.positional[2], out) ? 0 : 1;
+  }
+
+  // maps [x y z CHA MAPS], first map 1/sqrt(CHA)
+  Array make_maps(size_t x, size_t y, size_t z, size_t CHA, size_t MAPS, float f)
+  {
+    Array maps(std::vector<size_t>{x, y, z, CHA, MAPS});
+    std::fill(maps.data.begin(), maps.data.begin() + x*y*z*CHA, cfloat(1.0f/std::sqrt(float(CHA)) + f, 0.0f));
+    return maps;
+  }
+
+  // ecalib : maps [RO E1 E2 CHA MAPS] of the input size,
+  // with -1 the calibration table [1 1 1 CHA] read by ecaltwo
+  int tool_ecalib(const Args& args)
+  {
+    if (args.positional.size() < 2) return usage("ecalib", 2);
+    Array ksp;
+    if (!read_cfl(args.positional[0], ksp)) return 1;
+
+    if (args.has('1'))
+    {
+      Array table(std::vector<size_t>{1, 1, 1, ksp.dims[3]});
+      std::fill(table.data.begin(), table.data.end(), cfloat(1.0f + burn(ksp, "ecalib", 4), 0.0f));
+      return write_cfl(args.positional[1], table) ? 0 : 1;
+    }
+
+    size_t MAPS = std::max(1, std::atoi(args.get('m', "1").c_str()));
+    size_t CHA = ksp.dims[3];
+    float f = burn(ksp, "ecalib", 4);
+
+    Array maps = make_maps(ksp.dims[0], ksp.dims[1], ksp.dims[2], CHA, MAPS, f);
+
+    return write_cfl(args.positional[1], maps) ? 0 : 1;
+  }
+
+  // ecaltwo x y z : maps [x y z CHA MAPS] from the calibration table of ecalib -1
+  int tool_ecaltwo(const Args& args)
+  {
+    if (args.positional.size() != 5) return usage("ecaltwo", 5);
+    Array table;
+    if (!read_cfl(args.positional[3], table)) return 1;
+
+    size_t MAPS = std::max(1, std::atoi(args.get('m', "1").c_str()));
+    Array maps = make_maps(std::atoi(args.positional[0].c_str()), std::atoi(args.positional[1].c_str()), std::atoi(args.positional[2].c_str()), table.dims[3], MAPS, 0.0f);
+    float f = burn(maps, "ecaltwo", 1);
+    maps.data[0] += f;
+
+    return write_cfl(args.positional[4], maps) ? 0 : 1;
+  }
+
+  // show -d dim : size of one dimension
+  int tool_show(const Args& args)
+  {
+    if (args.positional.size() != 1) return usage("show", 1);
+    Array a;
+    if (!read_cfl(args.positional[0], a)) return 1;
+
+    if (args.has('d'))
+    {
+      std::cout << a.dims[std::min<size_t>(BART_DIMS - 1, std::atoi(args.get('d', "0").c_str()))] << std::endl;
+    }
+    else
+    {
+      std::copy(a.dims.begin(), a.dims.end(), std::ostream_iterator<size_t>(std::cout, " "));
+      std::cout << std::endl;
+    }
+    return 0;
+  }
+
+  // pics : image [RO E1 E2 1 MAPS ...] = coil combination of the kspace with the maps
+  int tool_pics(const Args& args)
+  {
+    if (args.positional.size() != 3) return usage("pics", 3);
+    Array ksp, maps;
+    if (!read_cfl(args.positional[0], ksp) || !read_cfl(args.positional[1], maps)) return 1;
+
+    size_t iter = std::max(1, std::atoi(args.get('i', "30").c_str()));
+    size_t CHA = ksp.dims[3];
+    size_t MAPS = maps.dims[4];
+    size_t vol = ksp.volume();
+    if ( (maps.volume() != vol) || (maps.dims[3] != CHA) )
+    {
+      std::cerr << "bart stub: pics, kspace and maps don't match" << std::endl;
+      return 1;
+    }
+    float f = burn(ksp, "pics", double(iter));
+
+    std::vector<size_t> dims = ksp.dims;
+    dims[3] = 1;
+    dims[4] = MAPS;
+    Array img(dims);
+    size_t batches = ksp.batches() / ksp.dims[4];
+    for (size_t b = 0; b < batches; b++)
+      for (size_t m = 0; m < MAPS; m++)
+	for (size_t c = 0; c < CHA; c++)
+	  for (size_t i = 0; i < vol; i++)
+	    img.data[(b*MAPS + m)*vol + i] += std::conj(maps.data[(m*CHA + c)*vol + i]) * ksp.data[(b*ksp.dims[4]*CHA + c)*vol + i] + f;
+
+    return write_cfl(args.positional[2], img) ? 0 : 1;
+  }
+
+  // fakeksp : kspace where sampled, image projected with the maps elsewhere
+  int tool_fakeksp(const Args& args)
+  {
+    if (args.positional.size() != 4) return usage("fakeksp", 4);
+    Array img, ksp, maps;
+    if (!read_cfl(args.positional[0], img) || !read_cfl(args.positional[1], ksp) || !read_cfl(args.positional[2], maps)) return 1;
+
+    size_t CHA = ksp.dims[3];
+    size_t MAPS = maps.dims[4];
+    size_t vol = ksp.volume();
+    float f = burn(ksp, "fakeksp", 1);
+
+    Array out(ksp.dims);
+    size_t batches = ksp.batches();
+    for (size_t b = 0; b < batches; b++)
+      for (size_t c = 0; c < CHA; c++)
+	for (size_t i = 0; i < vol; i++)
+	{
+	  cfloat v = ksp.data[(b*CHA + c)*vol + i];
+	  if (v == cfloat(0.0f) && img.data.size() >= (b/ksp.dims[4] + 1)*MAPS*vol)
+	    v = img.data[(b/ksp.dims[4])*MAPS*vol + i] * maps.data[c*vol + i];
+	  out.data[(b*CHA + c)*vol + i] = v + f;
+	}
+
+    return write_cfl(args.positional[3], out) ? 0 : 1;
+  }
+
+  // slice dim pos : position pos of dimension dim
+  int tool_slice(const Args& args)
+  {
+    if (args.positional.size() != 4) return usage("slice", 4);
+    Array in;
+    if (!read_cfl(args.positional[2], in)) return 1;
+
+    size_t dim = std::atoi(args.positional[0].c_str());
+    size_t pos = std::atoi(args.positional[1].c_str());
+    if ( (dim >= BART_DIMS) || (pos >= in.dims[dim]) )
+    {
+      std::cerr << "bart stub: slice, position " << pos << " is out of dimension " << dim << std::endl;
+      return 1;
+    }
+
+    size_t inner = std::accumulate(in.dims.begin(), in.dims.begin() + dim, size_t(1), std::multiplies<size_t>());
+    size_t outer = in.size() / (inner*in.dims[dim]);
+
+    std::vector<size_t> dims = in.dims;
+    dims[dim] = 1;
+    Array out(dims);
+    for (size_t o = 0; o < outer; o++)
+      std::copy(in.data.begin() + (o*in.dims[dim] + pos)*inner, in.data.begin() + (o*in.dims[dim] + pos + 1)*inner, out.data.begin() + o*inner);
+
+    return write_cfl(args.positional[3], out) ? 0 : 1;
+  }
+
+  // join dim in1 ... inN out : inputs concatenated along dimension dim
+  int tool_join(const Args& args)
+  {
+    if (args.positional.size() < 3) return usage("join", 3);
+    size_t dim = std::atoi(args.positional[0].c_str());
+    if (dim >= BART_DIMS)
+    {
+      std::cerr << "bart stub: join, no dimension " << dim << std::endl;
+      return 1;
+    }
+
+    std::vector<Array> in(args.positional.size() - 2);
+    std::vector<size_t> dims, first;
+    for (size_t k = 0; k < in.size(); k++)
+    {
+      if (!read_cfl(args.positional[k + 1], in[k])) return 1;
+      std::vector<size_t> d = in[k].dims;
+      d[dim] = 1;
+      if (k == 0)
+      {
+	first = d;
+	dims = d;
+	dims[dim] = 0;
+      }
+      else if (d != first)
+      {
+	std::cerr << "bart stub: join, " << args.positional[k + 1] << " doesn't match " << args.positional[1] << std::endl;
+	return 1;
+      }
+      dims[dim] += in[k].dims[dim];
+    }
+
+    size_t inner = std::accumulate(dims.begin(), dims.begin() + dim, size_t(1), std::multiplies<size_t>());
+    size_t outer = std::accumulate(dims.begin() + dim + 1, dims.end(), size_t(1), std::multiplies<size_t>());
+    Array out(dims);
+    auto dst = out.data.begin();
+    for (size_t o = 0; o < outer; o++)
+      for (auto & a : in)
+      {
+	auto src = a.data.begin() + o*a.dims[dim]*inner;
+	dst = std::copy(src, src + a.dims[dim]*inner, dst);
+      }
+
+    return write_cfl(args.positional.back(), out) ? 0 : 1;
+  }
+
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    std::cerr << "usage: " << argv[0] << " <tool> [options] <files>" << std::endl;
+    return 1;
+  }
+
+  std::string tool = argv[1];
+
+  if (tool == "version")
+  {
+    std::cout << "v0.0.0-stub" << std::endl;
+    return 0;
+  }
+  if (tool == "cc")
+    return tool_cc(Args(argc, argv, "prM"));
+  if (tool == "ccapply")
+    return tool_ccapply(Args(argc, argv, "p"));
+  if (tool == "ecalib")
+    return tool_ecalib(Args(argc, argv, "rkmtcan"));
+  if (tool == "ecaltwo")
+    return tool_ecaltwo(Args(argc, argv, "cm"));
+  if (tool == "show")
+    return tool_show(Args(argc, argv, "d"));
+  if (tool == "pics")
+    return tool_pics(Args(argc, argv, "rilRstp"));
+  if (tool == "fakeksp")
+    return tool_fakeksp(Args(argc, argv, ""));
+  if (tool == "slice")
+    return tool_slice(Args(argc, argv, ""));
+  if (tool == "join")
+    return tool_join(Args(argc, argv, ""));
+
+  std::cerr << "bart stub: unknown tool " << tool << std::endl;
+  return 1;
+}
@@ -0,0 +1,287 @@
+/*******************************************************************
+ * Description: Stand-in for the bart worker service of a recon node
+ * Runs the jobs BartReconGadget sends with bart_transport remote:
+ * receives the script, its arguments and the input files, runs the
+ * script with the given bart (e.g. bart_stub) in a job folder of its
+ * own and sends back the result and the output files, so that the
+ * remote path can be tested and timed on one box. It is a test tool:
+ * whoever has the shared secret runs any script as the worker's user.
+ * It listens on the loopback interface unless given another address,
+ * the secret is read from the -s file or BART_WORKER_TOKEN and every
+ * PING and JOB has to carry it, a client without it is dropped.
+ *
+ * usage: bart_worker [-a address] [-p port] [-s secret file] [-b bart] [-w work folder] [-j job slots] [-t omp threads] [-k]
+ * Lang: C++
+ *******************************************************************/
+
+#include "Bart_process.h"
+#include "Bart_transport.h"
+
+#include <boost/filesystem.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace Gadgetron;
+
+namespace {
+
+  struct WorkerConfig
+  {
+    WorkerConfig() : address("127.0.0.1"), port("9002"), bart("bart"), work_folder("/tmp"), slots(1), omp_threads(0), keep(false) {}
+
+    std::string address;
+    std::string port;
+    // shared secret of the clients
+    std::string token;
+    std::string bart;
+    std::string work_folder;
+    unsigned slots;
+    int omp_threads;
+    // job folders are kept for inspection
+    bool keep;
+  };
+
+  // a connection that is silent for longer is dropped, jobs keep it busy with heartbeats
+  const double IO_TIMEOUT_S = 60.0;
+  const std::chrono::seconds HEARTBEAT_PERIOD(1);
+
+  WorkerConfig config;
+  std::string worker_name;
+  std::atomic<unsigned> running(0);
+
+  // a job slot, given back when the job is over or didn't start
+  struct JobSlot
+  {
+    JobSlot() : held(true) {}
+    ~JobSlot() { release(); }
+    void release()
+    {
+      if (held)
+	running--;
+      held = false;
+    }
+    bool held;
+  };
+
+  bool plain_name(const std::string& name)
+  {
+    return !name.empty() && name != "." && name != ".." && name.find('/') == std::string::npos;
+  }
+
+  // reads the frames of a job that isn't taken up to its JOB_END
+  void drain_job(BartWire::Channel& channel)
+  {
+    std::string payload;
+    while (channel.receive(payload) != BartWire::JOB_END)
+      ;
+  }
+
+  void run_job(BartWire::Channel& channel, const std::string& job_payload)
+  {
+    BartWire::JobRequest request = BartWire::JobRequest::decode(job_payload);
+
+    JobSlot slot;
+    if (running.fetch_add(1) >= config.slots)
+    {
+      slot.release();
+      drain_job(channel);
+      BartWire::Writer failure;
+      failure.str(BartWire::BUSY_FAILURE);
+      channel.send(BartWire::FAILURE, failure.data());
+      return;
+    }
+
+    std::string folder_template = config.work_folder + "/bart_job.XXXXXX";
+    if (!plain_name(request.script_name) || !::mkdtemp(&folder_template[0]))
+    {
+      slot.release();
+      drain_job(channel);
+      BartWire::Writer failure;
+      failure.str(plain_name(request.script_name) ? "can't create a job folder" : "script name refused");
+      channel.send(BartWire::FAILURE, failure.data());
+      return;
+    }
+    std::string folder = folder_template + "/";
+
+    std::atomic<bool> cancel(false);
+    try
+    {
+      std::string payload;
+      for (uint32_t type = channel.receive(payload); type != BartWire::JOB_END; type = channel.receive(payload))
+      {
+	if (type != BartWire::FILE_BEGIN)
+	  throw BartWire::Error("unexpected frame " + std::to_string(type));
+	BartWire::receive_file(channel, payload, folder);
+      }
+      std::ofstream(folder + request.script_name, std::ios::binary) << request.script;
+
+      BartProcessSpec spec;
+      spec.argv = { "/bin/sh", folder + request.script_name };
+      spec.argv.insert(spec.argv.end(), request.args.begin(), request.args.end());
+      spec.working_directory = folder;
+      spec.environment = request.environment;
+      spec.environment["BART"] = config.bart;
+      spec.environment["OMP_NUM_THREADS"] = std::to_string((config.omp_threads > 0) ? config.omp_threads : std::max(1, availableCpus() / static_cast<int>(config.slots)));
+      spec.log_file = folder + "bart_job.log";
+      spec.timeout_s = request.timeout_s;
+      spec.cancel = &cancel;
+
+      // the client is told that the worker is alive while the job runs, the job is killed when it is gone
+      std::future<BartProcessResult> job = std::async(std::launch::async, [&]() { return BartProcessLauncher::instance().run(spec); });
+      while (job.wait_for(HEARTBEAT_PERIOD) != std::future_status::ready)
+      {
+	if (cancel)
+	  continue;
+	try
+	{
+	  channel.send(BartWire::HEARTBEAT, std::string());
+	}
+	catch (const BartWire::Error&)
+	{
+	  cancel = true;
+	}
+      }
+      BartProcessResult result = job.get();
+      slot.release();
+
+      if (cancel)
+	throw BartWire::Error("client is gone, job cancelled");
+
+      std::cerr << "bart worker: job " << folder << " : " << result.describe() << std::endl;
+      channel.send(BartWire::RESULT, BartWire::encode_result(result, BartProcessLauncher::tail(spec.log_file, 200), worker_name));
+      for (auto & name : request.outputs)
+      {
+	if (plain_name(name) && boost::filesystem::exists(folder + name))
+	  BartWire::send_file(channel, folder + name, name, request.compress && BartWire::compression_available());
+      }
+      channel.send(BartWire::JOB_END, std::string());
+    }
+    catch (...)
+    {
+      if (!config.keep)
+	boost::filesystem::remove_all(folder);
+      throw;
+    }
+
+    if (!config.keep)
+      boost::filesystem::remove_all(folder);
+  }
+
+  void serve(std::shared_ptr<BartWire::Channel> channel)
+  {
+    try
+    {
+      std::string payload;
+      while (true)
+      {
+	uint32_t type = channel->receive(payload);
+	if ( (type == BartWire::PING || type == BartWire::JOB) && !BartWire::authorized(payload, config.token) )
+	{
+	  BartWire::Writer failure;
+	  failure.str("not authorized");
+	  channel->send(BartWire::FAILURE, failure.data());
+	  throw BartWire::Error("client without the shared secret dropped");
+	}
+	if (type == BartWire::PING)
+	  channel->send(BartWire::PONG, BartWire::encode_pong(running.load(), config.slots, worker_name));
+	else if (type == BartWire::JOB)
+	  run_job(*channel, payload);
+	else
+	  throw BartWire::Error("unexpected frame " + std::to_string(type));
+      }
+    }
+    catch (const BartWire::Error& error)
+    {
+      // a client closing its connection after its job is the normal end
+      std::string what = error.what();
+      if (what.find("End of file") == std::string::npos)
+	std::cerr << "bart worker: " << what << std::endl;
+    }
+    channel->close();
+  }
+
+}
+
+int main(int argc, char** argv)
+{
+  int opt;
+  std::string token_file;
+  while ((opt = ::getopt(argc, argv, "a:p:s:b:w:j:t:kh")) != -1)
+  {
+    switch (opt)
+    {
+    case 'a': config.address = optarg; break;
+    case 'p': config.port = optarg; break;
+    case 's': token_file = optarg; break;
+    case 'b': config.bart = optarg; break;
+    case 'w': config.work_folder = optarg; break;
+    case 'j': config.slots = std::max(1, std::atoi(optarg)); break;
+    case 't': config.omp_threads = std::atoi(optarg); break;
+    case 'k': config.keep = true; break;
+    default:
+      std::cerr << "usage: " << argv[0] << " [-a address] [-p port] [-s secret file] [-b bart] [-w work folder] [-j job slots] [-t omp threads] [-k]" << std::endl;
+      return 1;
+    }
+  }
+
+  // the secret isn't taken from the command line, where every user of the box sees it
+  if (!token_file.empty())
+  {
+    std::ifstream file(token_file);
+    std::getline(file, config.token);
+  }
+  else if (std::getenv("BART_WORKER_TOKEN"))
+    config.token = std::getenv("BART_WORKER_TOKEN");
+  if (config.token.empty())
+  {
+    std::cerr << "bart worker: no shared secret, give a secret file with -s or set BART_WORKER_TOKEN" << std::endl;
+    return 1;
+  }
+
+  // the bart of the jobs is found whatever their working directory
+  config.bart = boost::filesystem::absolute(config.bart).string();
+  if (!boost::filesystem::exists(config.bart))
+  {
+    std::cerr << "bart worker: can't find bart executable " << config.bart << std::endl;
+    return 1;
+  }
+
+  char host[256] = { 0 };
+  ::gethostname(host, sizeof(host) - 1);
+  worker_name = std::string(host) + ":" + config.port;
+
+  ::signal(SIGPIPE, SIG_IGN);
+
+  try
+  {
+    boost::asio::io_context io;
+    boost::asio::ip::tcp::acceptor acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(config.address), static_cast<unsigned short>(std::atoi(config.port.c_str()))));
+    std::cerr << "bart worker: " << worker_name << " on " << config.address << ", " << config.slots << " job slot(s), bart " << config.bart << std::endl;
+
+    while (true)
+    {
+      std::shared_ptr<BartWire::Channel> channel = std::make_shared<BartWire::Channel>(IO_TIMEOUT_S);
+      acceptor.accept(channel->socket());
+      std::thread(serve, channel).detach();
+    }
+  }
+  catch (const std::exception& error)
+  {
+    std::cerr << "bart worker: " << error.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
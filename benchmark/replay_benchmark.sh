@@ -0,0 +1,161 @@
+#!/bin/bash
+
+# Replays ISMRMRD datasets through a gadget chain and reports, for every dataset,
+# the end-to-end latency, the time of every timed gadget step and the peak memory
+# of the gadgetron process. The bart gadgets are pointed at the given bart binary,
+# by default the deterministic bart_stub next to this script, so that the
+# BART_Recon*.xml chains can be measured on any Linux box.
+
+CONFIG=BART_Recon.xml
+BART=
+WORKDIR=
+PORT=9099
+REPEATS=1
+SYNTHETIC=0
+WORKERS=0
+WORKER_PIDS=
+TOKEN=
+
+usage()
+{
+	echo "Usage: $0 [-c config.xml] [-b bart] [-w workdir] [-p port] [-n repeats] [-R workers] [-s] [dataset.h5 ...]"
+	echo "  -c  gadget chain to replay (file or name in the gadgetron config folder, default ${CONFIG})"
+	echo "  -b  bart executable of the bart gadgets (default: bart_stub next to this script)"
+	echo "  -w  bart working directory (default: a temporary folder)"
+	echo "  -p  gadgetron port (default ${PORT})"
+	echo "  -n  number of replays of every dataset (default ${REPEATS})"
+	echo "  -R  run the bart jobs of BartReconGadget on this number of local bart_worker processes (remote transport),"
+	echo "      bart_worker isn't installed, it is taken from BART_WORKER, next to this script or from the PATH"
+	echo "  -s  add a synthetic dataset made by ismrmrd_generate_cartesian_shepp_logan"
+	echo "The cost of the bart stub is set with BART_STUB_COST and BART_STUB_COST_<TOOL>."
+	exit 1
+}
+
+while getopts "c:b:w:p:n:R:sh" opt; do
+	case $opt in
+	c) CONFIG=$OPTARG ;;
+	b) BART=$OPTARG ;;
+	w) WORKDIR=$OPTARG ;;
+	p) PORT=$OPTARG ;;
+	n) REPEATS=$OPTARG ;;
+	R) WORKERS=$OPTARG ;;
+	s) SYNTHETIC=1 ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND-1))
+
+DATASETS=("$@")
+
+SCRATCH=$(mktemp -d /tmp/bart_replay.XXXXXX)
+trap 'kill ${WORKER_PIDS} 2> /dev/null; rm -rf "${SCRATCH}"' EXIT
+
+if [ -z "${BART}" ] ; then
+	BART=$(dirname "$(readlink -f "$0")")/bart_stub
+	[ -x "${BART}" ] || BART=$(command -v bart_stub)
+fi
+if [ ! -x "${BART}" ] ; then
+	echo "Can't find bart executable ${BART}" >&2
+	exit 1
+fi
+BART=$(readlink -f "${BART}")
+
+if [ -z "${WORKDIR}" ] ; then
+	WORKDIR=${SCRATCH}/work
+fi
+mkdir -p "${WORKDIR}"
+
+if [ ! -f "${CONFIG}" ] && [ -n "${GADGETRON_HOME}" ] ; then
+	CONFIG=${GADGETRON_HOME}/share/gadgetron/config/${CONFIG}
+fi
+if [ ! -f "${CONFIG}" ] ; then
+	echo "Can't find gadget chain ${CONFIG}" >&2
+	exit 1
+fi
+
+if [ ${SYNTHETIC} -eq 1 ] ; then
+	( cd "${SCRATCH}" && ismrmrd_generate_cartesian_shepp_logan -m 256 -c 32 -a 2 -r 1 -o synthetic.h5 > /dev/null ) || exit 1
+	DATASETS+=("${SCRATCH}/synthetic.h5")
+fi
+if [ ${#DATASETS[@]} -eq 0 ] ; then
+	usage
+fi
+
+# stand-in workers of the remote transport on local ports, running the same bart
+TRANSPORT=local
+REMOTE_WORKERS=
+if [ ${WORKERS} -gt 0 ] ; then
+	WORKER=${BART_WORKER:-$(dirname "$(readlink -f "$0")")/bart_worker}
+	[ -x "${WORKER}" ] || WORKER=$(command -v bart_worker)
+	if [ ! -x "${WORKER}" ] ; then
+		echo "Can't find bart_worker" >&2
+		exit 1
+	fi
+	# a secret of this replay, shared by the workers and the gadget
+	TOKEN=$(od -An -tx1 -N16 /dev/urandom | tr -d ' \n')
+	( umask 077 && echo "${TOKEN}" > "${SCRATCH}/worker_token" )
+	for i in $(seq 1 "${WORKERS}") ; do
+		WORKER_PORT=$((PORT + 100 + i))
+		mkdir -p "${SCRATCH}/worker_${i}"
+		"${WORKER}" -a 127.0.0.1 -p "${WORKER_PORT}" -s "${SCRATCH}/worker_token" -b "${BART}" -w "${SCRATCH}/worker_${i}" 2> "${SCRATCH}/worker_${i}.log" &
+		WORKER_PIDS="${WORKER_PIDS} $!"
+		REMOTE_WORKERS=${REMOTE_WORKERS:+${REMOTE_WORKERS},}127.0.0.1:${WORKER_PORT}
+	done
+	TRANSPORT=remote
+fi
+
+# the bart gadgets of the chain use the given bart binary and working directory,
+# BartReconGadget the bart transport
+CHAIN=${SCRATCH}/$(basename "${CONFIG}")
+sed -e '/<name>BartBinary_path<\/name>/d' -e '/<name>BartWorkingDirectory<\/name>/d' \
+    -e '/<name>bart_transport<\/name>/d' -e '/<name>remote_workers<\/name>/d' -e '/<name>remote_token<\/name>/d' \
+    -e "s#\(<classname>Bart[A-Za-z]*Gadget</classname>\)#\1\n    <property><name>BartBinary_path</name><value>${BART}</value></property>\n    <property><name>BartWorkingDirectory</name><value>${WORKDIR}/</value></property>#" \
+    -e "s#\(<classname>BartReconGadget</classname>\)#\1\n    <property><name>bart_transport</name><value>${TRANSPORT}</value></property>\n    <property><name>remote_workers</name><value>${REMOTE_WORKERS}</value></property>\n    <property><name>remote_token</name><value>${TOKEN}</value></property>#" \
+    "${CONFIG}" > "${CHAIN}"
+
+echo "Chain   : ${CONFIG}"
+echo "Bart    : ${BART}"
+echo "Workdir : ${WORKDIR}"
+if [ -n "${REMOTE_WORKERS}" ] ; then
+	echo "Workers : ${REMOTE_WORKERS}"
+fi
+echo
+
+printf "%-40s %4s %12s %14s\n" "dataset" "run" "latency [s]" "peak RSS [MB]"
+
+for DATASET in "${DATASETS[@]}" ; do
+	for RUN in $(seq 1 "${REPEATS}") ; do
+		LOG=${SCRATCH}/gadgetron_${RUN}.log
+		TIMING=${SCRATCH}/time_${RUN}.txt
+
+		# a fresh gadgetron per replay, so that the peak memory belongs to this dataset
+		/usr/bin/time -v -o "${TIMING}" gadgetron -p "${PORT}" > "${LOG}" 2>&1 &
+		TIME_PID=$!
+
+		for i in $(seq 1 100) ; do
+			(echo > /dev/tcp/localhost/${PORT}) 2> /dev/null && break
+			sleep 0.1
+		done
+
+		START=$(date +%s.%N)
+		gadgetron_ismrmrd_client -f "${DATASET}" -C "${CHAIN}" -p "${PORT}" -o "${SCRATCH}/out_${RUN}.h5" > "${SCRATCH}/client_${RUN}.log" 2>&1
+		STATUS=$?
+		END=$(date +%s.%N)
+
+		pkill -INT -P "${TIME_PID}"
+		wait "${TIME_PID}" 2> /dev/null
+
+		LATENCY=$(echo "${END} - ${START}" | bc)
+		PEAK_KB=$(sed -n 's/.*Maximum resident set size (kbytes): *\([0-9]*\).*/\1/p' "${TIMING}")
+		if [ ${STATUS} -ne 0 ] ; then
+			LATENCY="failed"
+		fi
+		printf "%-40s %4d %12s %14s\n" "$(basename "${DATASET}")" "${RUN}" "${LATENCY}" "$(( ${PEAK_KB:-0} / 1024 ))"
+
+		# time of the timed gadget steps, summed over the calls
+		grep -oE '[A-Za-z0-9_]+Gadget::[^:]*: *[0-9.]+ *ms' "${LOG}" \
+		| sed -e 's/: *\([0-9.]*\) *ms$/\t\1/' \
+		| awk -F '\t' '{ t[$1] += $2; n[$1]++ } END { for (k in t) printf "    %-70s %6d x %12.1f ms\n", k, n[k], t[k] }' \
+		| sort
+	done
+done